@@ -1,12 +1,58 @@
 // Copyright Munteanu Eugen 315CAb 2022-2023
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdarg.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // showing variable name in error message (defensive programming)
 #define var_name(name) #name
 
+// pixel buffers start on a cache line boundary
+#define PIXEL_ALIGN 64
+
+// sample types an image can be stored with, chosen at LOAD time from
+// max_color; every kernel declared through it exists once per type
+#define SAMPLE_TYPES(X) \
+	X(u8, uint8_t) \
+	X(u16, uint16_t)
+
+// call the kernel generated for the sample type of the image
+#define SAMPLE_CALL(image, kernel, ...) \
+	((*(image)).depth == 1 ? kernel##_u8(__VA_ARGS__) : \
+	 kernel##_u16(__VA_ARGS__))
+
+// one filter of APPLY and the selection it runs on (recorded in
+// PIPELINE ON mode until the image is needed)
+struct apply_step {
+	char param; double value; // value - BOX_BLUR radius, GAUSSIAN sigma
+	struct conv_kernel *kernel; // KERNEL <file> (owned by the step)
+	int x1, y1, x2, y2;
+};
+
+// command recorded for a streamed image (LOAD <file> stream)
+struct stream_stage {
+	char op; // 'C' - CROP, 'L' - point operations, 'A' - APPLY
+	int x1, y1, x2, y2; // CROP: the selection
+	int *lut; // point operations, composed
+	struct apply_step *steps; int count; // filters, with their selections
+};
+
+struct stream_source {
+	FILE *file; long offset; // the file and the position of its matrix
+	struct tile_store *tiles; int view[2][3]; // or a scratch store, seen
+	// through a map (as view of image_data)
+	int width, height; // of the image read (before the stages)
+	struct stream_stage *stages; int stage_count;
+};
+
 struct image_data {
 	char type[2]; // image type, e.g. P5
 
@@ -16,9 +62,27 @@ struct image_data {
 	int x2; int y2; // SELECT <x1> <y1> <x2> <y2> etc.
 
 	int max_color;
-	int ***area;
-	// area[0][i][j]    - grayscale image
-	// area[0..2][i][j] - color image
+
+	int channels;  // 1 - grayscale, 3 - color
+	int depth;     // bytes per sample: 1 (uint8_t) or 2 (uint16_t)
+	size_t stride; // samples between the beginnings of two consecutive rows
+	void *area;    // first pixel of the image, inside base or map
+	void *base; size_t base_size; // allocated buffer (NULL - mapped file)
+	void *map; size_t map_size; // LOAD <file> mmap: private file mapping,
+	dev_t map_dev; ino_t map_ino; // area points inside it (copy-on-write)
+	int *lut; // pending point operations, composed (NULL - none)
+	int pipeline; // PIPELINE ON: geometry and filters are only recorded
+	int remapped; int view[2][3]; // pending rotations, flips and crops:
+	// pixel (i, j) is (view[0] . (1, i, j), view[1] . (1, i, j)) of area
+	struct apply_step *applies; int apply_count; // pending filters
+	struct stream_source *stream; // LOAD <file> stream (NULL - in memory)
+	void *spare; size_t spare_size; // buffer of the previous image (batch
+	// mode), reused by the next LOAD it is large enough for
+	// the image is a view of one buffer of samples, channels interleaved
+	// (after CROP, only a part of its rows and columns):
+	// area[i * stride + j * channels + k], where k is
+	// 0 - grayscale image
+	// 0..2 (R, G, B) - color image
 };
 
 int is_number(char x)
@@ -52,471 +116,3089 @@ double clamp(double x, double min_value, double max_value)
 	return x;
 }
 
-int aloc_triple_ptr(int ****ptr, int type, int lines, int elems)
+// where the messages of commands go: stdout, or (batch mode) a buffer
+// of the worker thread, printed once the script ends for the file
+__thread FILE *messages;
+
+void report(const char *format, ...)
 {
-	// triple int*** ptr dynamic allocation
-	*ptr = (int ***)malloc(type * sizeof(int **));
-	for (int k = 0; k < type; k++) {
-		(*ptr)[k] = (int **)malloc(lines * sizeof(int *));
-		if (!((*ptr)[k])) {
-			fprintf(stderr, "Malloc for %s failed\n", var_name(*ptr));
-			for (int i = 0; i < k; i++)
-				free((*ptr)[k]);
-			free(*ptr); *ptr = NULL;
-			return 0;
-		}
-	}
-	for (int k = 0; k < type; k++)
-		for (int i = 0; i < lines; i++) {
-			(*ptr)[k][i] = (int *)malloc(elems * sizeof(int));
-			if (!((*ptr)[k][i])) {
-				fprintf(stderr, "Malloc for %s failed\n", var_name(*ptr));
-				for (int k_f = 0; k_f < type; k_f++) {
-					for (int j = 0; j < i; j++)
-						free((*ptr)[k_f][j]);
-					free((*ptr)[k_f]);
-				}
-				free(*ptr); (*ptr) = NULL;
-				return 0;
-			}
-		}
-	return 1;
+	va_list args;
+	va_start(args, format);
+	vfprintf(messages ? messages : stdout, format, args);
+	va_end(args);
 }
 
-void free_image(struct image_data *image, int all)
+// strtok, with the position kept per thread (batch workers parse
+// their commands at the same time)
+__thread char *token_position;
+
+char *command_token(char *text, const char *delimiters)
 {
-	// free all allocated resources for image
-	if ((*image).type[1] == '2' || (*image).type[1] == '5') {
-		// grayscale image
+	return strtok_r(text, delimiters, &token_position);
+}
 
-		for (int i = 0; i < (*image).height; i++)
-			if ((*image).area[0][i])
-				free((*image).area[0][i]);
-		if ((*image).area[0])
-			free((*image).area[0]);
-		if ((*image).area)
-			free((*image).area);
-		(*image).area = NULL;
+// pool of worker threads, created once at startup (THREADS <n> resizes
+// it); a job is split into tasks, run by the workers and the caller
+struct thread_pool {
+	int size;           // threads working on a job, caller included
+	pthread_t *threads; // the size - 1 workers
+	pthread_mutex_t lock;
+	pthread_cond_t start, finish;
+
+	void (*task)(void *, int); // current job: task(arg, 0..tasks - 1)
+	void *arg;
+	int tasks, next, running;
+	unsigned long round; // incremented for each job
+	int busy, stop;
+};
 
-	} else {
-		// color image
+struct thread_pool pool;
 
-		for (int k = 0; k < 3; k++) {
-			for (int i = 0; i < (*image).height; i++)
-				if ((*image).area[k][i])
-					free((*image).area[k][i]);
-			if ((*image).area[k])
-				free((*image).area[k]);
-		}
-		if ((*image).area)
-			free((*image).area);
-		(*image).area = NULL;
-	}
+// held by a thread other than the one running the commands while it
+// may use the pool (the LOAD decoder of the I/O thread), and by THREADS
+// while the pool is rebuilt
+pthread_mutex_t pool_rebuild = PTHREAD_MUTEX_INITIALIZER;
 
-	// reinitialize variables to null if given, else
-	// keep metadata for a possible new image
-	if (all == 1) {
-		(*image).type[0] = '\0'; (*image).type[1] = '\0';
+void pool_drain(struct thread_pool *pool)
+{
+	// run tasks of the current job until none is left
+	// (called with the lock held)
+	while ((*pool).next < (*pool).tasks) {
+		int index = (*pool).next++;
 
-		(*image).width = 0; (*image).height = 0;
-		(*image).x1 = 0; (*image).y1 = 0;
-		(*image).x2 = 0; (*image).y2 = 0;
+		pthread_mutex_unlock(&(*pool).lock);
+		(*pool).task((*pool).arg, index);
+		pthread_mutex_lock(&(*pool).lock);
 
-		(*image).max_color = 0;
+		if (--(*pool).running == 0)
+			pthread_cond_broadcast(&(*pool).finish);
 	}
 }
 
-void read_before_matrix(FILE **image_file, struct image_data *image)
+void *pool_worker(void *arg)
 {
-	// read the input data from file, stopping at the beginning of the matrix
-
-	// find the image type in the file (P2/P3/P5/P6)
-	rewind(*image_file);
-	for (int i = 0; i < 2; i++)
-		(*image).type[i] = fgetc(*image_file);
-
-	int binary = 0; // if file is binary or not
-
-	// iterate through file character by character
-	unsigned char chr = fgetc(*image_file);
+	struct thread_pool *pool = (struct thread_pool *)arg;
+	unsigned long seen = 0;
 
+	pthread_mutex_lock(&(*pool).lock);
 	while (1) {
-		// skip comments
-		if (chr == '#') {
-			char *comment; fscanf(*image_file, "%m[^\n]", &comment);
-			fgetc(*image_file); // skip newline
-			free(comment);
-			chr = fgetc(*image_file); continue;
-		}
-
-		// if the file is not binary, skip whitespaces
-		if (!(is_number(chr)) && !binary) {
-			chr = fgetc(*image_file); continue;
-		}
-
-		// read width and height of the image
-		if ((*image).width == 0 && (*image).height == 0) {
-			// iterate through file character by character,
-			// skipping whitespaces to get them properly
-
-			// width
-			fseek(*image_file, -1, SEEK_CUR);
-			char *aux = (char *)calloc(10, sizeof(char));
-			char num = fgetc(*image_file);
-			int i = 0;
-			while (is_number(num)) {
-				aux[i++] = num; num = fgetc(*image_file);
-			}
-			(*image).width = atoi(aux); free(aux);
-
-			// height
-			while (!(is_number(num)))
-				num = fgetc(*image_file);
-			aux = (char *)calloc(10, sizeof(char));
-			i = 0;
-			while (is_number(num)) {
-				aux[i++] = num; num = fgetc(*image_file);
-			}
-			(*image).height = atoi(aux); free(aux);
-
-			chr = fgetc(*image_file); continue;
-		}
-
-		// read max value of a pixel
-		if ((*image).max_color == 0) {
-			char *aux = (char *)calloc(5, sizeof(char));
-			int i = 0;
-			while (is_number(chr)) {
-				aux[i++] = chr; chr = fgetc(*image_file);
-			}
-			(*image).max_color = atoi(aux); free(aux);
+		while (!(*pool).stop && (*pool).round == seen)
+			pthread_cond_wait(&(*pool).start, &(*pool).lock);
+		if ((*pool).stop)
+			break;
 
-			// now, we're at the beginning of the matrix, check
-			// if the file is binary
-			if ((*image).type[1] == '5' || (*image).type[1] == '6') {
-				binary = 1;
-				chr = fgetc(*image_file);
-			}
-			continue;
-		}
-		// in another function we will load the matrix in memory,
-		// depending on the file and image type
-		fseek(*image_file, -1, SEEK_CUR); return;
+		seen = (*pool).round;
+		pool_drain(pool);
 	}
+	pthread_mutex_unlock(&(*pool).lock);
+	return NULL;
 }
 
-void P2_case(FILE **image_file, struct image_data *image)
+void pool_init(struct thread_pool *pool, int size)
 {
-	// P2 case (text file, grayscale image)
-
-	// free resources (if another image exists)
-	if ((*image).area)
-		free_image(&(*image), 1);
-
-	// read input data until the beginning of the matrix
-	read_before_matrix(&(*image_file), &(*image));
-
-	unsigned char chr = fgetc(*image_file);
-	// allocate memory for the matrix
-	// convention -- grayscale: (*image).area[0][i][j]
-
-	int m = (*image).width;
-	int n = (*image).height;
-
-	aloc_triple_ptr(&((*image).area), 1, n, m);
-
-	for (int i = 0; i < n; i++) {
-		for (int j = 0; j < m; j++) {
-			// next element in the matrix
-
-			while (!(is_number(chr)))
-				chr = fgetc(*image_file);
-			int k = 0;
-			char *aux = (char *)calloc(5, sizeof(char));
-			while ((is_number(chr))) {
-				aux[k++] = chr;
-				chr = fgetc(*image_file);
-			}
-			(*image).area[0][i][j] = atoi(aux);
+	pthread_mutex_init(&(*pool).lock, NULL);
+	pthread_cond_init(&(*pool).start, NULL);
+	pthread_cond_init(&(*pool).finish, NULL);
+	(*pool).round = 0; (*pool).busy = 0; (*pool).stop = 0;
+	(*pool).tasks = 0; (*pool).next = 0; (*pool).running = 0;
+
+	// start the workers; on failure, keep the ones that started
+	(*pool).size = 1;
+	(*pool).threads = NULL;
+	if (size > 1)
+		(*pool).threads = (pthread_t *)malloc((size - 1) * sizeof(pthread_t));
+	if (!(*pool).threads)
+		return;
 
-			free(aux);
+	for (int i = 0; i < size - 1; i++) {
+		if (pthread_create(&(*pool).threads[i], NULL, pool_worker, pool)) {
+			fprintf(stderr, "Pthread_create for %s failed\n",
+					var_name(pool));
+			break;
 		}
+		(*pool).size++;
 	}
 }
 
-void P3_case(FILE **image_file, struct image_data *image)
+void pool_destroy(struct thread_pool *pool)
 {
-	// P3 case (text file, color image)
-
-	// free resources (if another image exists)
-	if ((*image).area)
-		free_image(&(*image), 1);
-
-	// read input data until the beginning of the matrix
-	read_before_matrix(&(*image_file), &(*image));
-
-	unsigned char chr = fgetc(*image_file);
-
-	// allocate memory for the matrix
-	// convention -- color: (*image).area[0..2][i][j], where
-	// 0 - red; 1 - green; 2 - blue
+	pthread_mutex_lock(&(*pool).lock);
+	(*pool).stop = 1;
+	pthread_cond_broadcast(&(*pool).start);
+	pthread_mutex_unlock(&(*pool).lock);
+
+	for (int i = 0; i < (*pool).size - 1; i++)
+		pthread_join((*pool).threads[i], NULL);
+	free((*pool).threads);
+	(*pool).threads = NULL;
+
+	pthread_cond_destroy(&(*pool).start);
+	pthread_cond_destroy(&(*pool).finish);
+	pthread_mutex_destroy(&(*pool).lock);
+}
 
-	int m = (*image).width;
-	int n = (*image).height;
+void pool_run(struct thread_pool *pool, void (*task)(void *, int),
+			  void *arg, int tasks)
+{
+	// run task(arg, i) for i = 0..tasks - 1 and wait for all of them;
+	// if the pool is already running a job, the caller runs them alone
+	pthread_mutex_lock(&(*pool).lock);
+	if ((*pool).size <= 1 || tasks <= 1 || (*pool).busy) {
+		pthread_mutex_unlock(&(*pool).lock);
+		for (int i = 0; i < tasks; i++)
+			task(arg, i);
+		return;
+	}
 
-	aloc_triple_ptr(&((*image).area), 3, n, m);
+	(*pool).busy = 1;
+	(*pool).task = task; (*pool).arg = arg;
+	(*pool).tasks = tasks; (*pool).next = 0; (*pool).running = tasks;
+	(*pool).round++;
+	pthread_cond_broadcast(&(*pool).start);
 
-	for (int i = 0; i < n; i++)
-		for (int j = 0; j < m; j++)
-			for (int k = 0; k < 3; k++) {
-				// next element in the matrix
-
-				while (!(is_number(chr)))
-					chr = fgetc(*image_file);
-				char *aux = (char *)calloc(10, sizeof(char));
-				int nr = 0;
-				while ((is_number(chr))) {
-					aux[nr++] = chr;
-					chr = fgetc(*image_file);
-				}
-				(*image).area[k][i][j] = atoi(aux);
+	pool_drain(pool);
+	while ((*pool).running > 0)
+		pthread_cond_wait(&(*pool).finish, &(*pool).lock);
 
-				free(aux);
-			}
+	(*pool).busy = 0;
+	pthread_mutex_unlock(&(*pool).lock);
 }
 
-void P5_case(FILE **image_file, struct image_data *image)
+int default_threads(void)
 {
-	// P5 case (binary file, grayscale image)
+	// IMAGE_EDITOR_THREADS if set, else one thread per online CPU
+	char *value = getenv("IMAGE_EDITOR_THREADS");
+	if (value && atoi(value) > 0)
+		return atoi(value);
 
-	// free resources (if another image exists)
-	if ((*image).area)
-		free_image(&(*image), 1);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (int)cpus : 1;
+}
 
-	// read input data until the beginning of the matrix
-	read_before_matrix(&(*image_file), &(*image));
+// chunk size of the buffered reader used for text files (P2/P3)
+#define READER_CHUNK (1 << 20)
 
-	unsigned char chr = fgetc(*image_file);
+// bytes kept ahead of the parsing position, so that
+// a number is never split between two chunks
+#define READER_LOOKAHEAD 64
 
-	// check if we're right before the first element in the image matrix
-	if (chr == '\r' || chr == '\n')
-		chr = fgetc(*image_file);
+struct text_reader {
+	FILE *file;
+	size_t chunk; // bytes read at a time (READER_CHUNK, or a multiple)
+	unsigned char *buffer; // chunk + READER_LOOKAHEAD bytes
+	size_t pos, len;
+	int eof;
+};
 
-	int num_int = 0; // chr -> int transformation
+int reader_init(struct text_reader *reader, FILE *file, size_t chunk)
+{
+	// the reader continues from the current position in the file
+	(*reader).file = file;
+	(*reader).chunk = chunk;
+	(*reader).pos = 0; (*reader).len = 0; (*reader).eof = 0;
+	(*reader).buffer = (unsigned char *)malloc(chunk + READER_LOOKAHEAD);
+	if (!(*reader).buffer) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(buffer));
+		return 0;
+	}
+	return 1;
+}
 
-	// allocate memory for the matrix
-	// convention -- grayscale: (*image).area[0][i][j]
+void reader_fill(struct text_reader *reader)
+{
+	// move the unparsed bytes to the beginning and read the next chunk
+	size_t left = (*reader).len - (*reader).pos;
+	memmove((*reader).buffer, (*reader).buffer + (*reader).pos, left);
+	(*reader).pos = 0;
+
+	size_t read = fread((*reader).buffer + left, 1,
+						(*reader).chunk + READER_LOOKAHEAD - left,
+						(*reader).file);
+	(*reader).len = left + read;
+	if (read == 0)
+		(*reader).eof = 1;
+}
 
-	int m = (*image).width;
-	int n = (*image).height;
+static inline int digit_run(const unsigned char *p)
+{
+	// number of consecutive digits (0..8) at p, looking at 8 bytes at once
+	// (SWAR): a byte is a digit if, after xor with '0', its high nibble
+	// is 0 and its low nibble is at most 9
+	uint64_t chunk;
+	memcpy(&chunk, p, sizeof(chunk));
+
+	uint64_t t = chunk ^ 0x3030303030303030ULL;
+	uint64_t bad = (t & 0xF0F0F0F0F0F0F0F0ULL) |
+				   (((t & 0x0F0F0F0F0F0F0F0FULL) + 0x0606060606060606ULL) &
+					0x1010101010101010ULL);
+	bad = (bad | bad << 1 | bad << 2 | bad << 3) & 0x8080808080808080ULL;
+	if (!bad)
+		return 8;
+
+	// the first byte in memory is the lowest one
+	return __builtin_ctzll(bad) / 8;
+}
 
-	aloc_triple_ptr(&((*image).area), 1, n, m);
+static inline int digits_value(const unsigned char *p, int len)
+{
+	// value of the len (1..8) digits at p, combined pairwise
+	// in a single 64-bit word (SWAR)
+	uint64_t chunk;
+	memcpy(&chunk, p, sizeof(chunk));
+
+	// keep only the digits, aligned to the top bytes (leading zeros)
+	chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - len)));
+	chunk = (chunk * 2561) >> 8;
+	chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	chunk = ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+	return (int)chunk;
+}
 
-	for (int i = 0; i < n; i++) {
-		for (int j = 0; j < m; j++) {
-			// next element in the matrix
+static inline const unsigned char *scan_number(const unsigned char *p,
+											   const unsigned char *end,
+											   int *value)
+{
+	// decode the number starting at p (a digit); return its end
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (end - p >= 8) {
+		int len = digit_run(p);
+		if (len < 8) {
+			*value = digits_value(p, len);
+			return p + len;
+		}
+	}
+#endif
+	int num = 0;
+	while (p < end && is_number(*p))
+		num = num * 10 + (*p++ - '0');
+	*value = num;
+	return p;
+}
 
-			num_int = (int)chr;
-			(*image).area[0][i][j] = num_int;
-			chr = fgetc(*image_file);
+int reader_numbers(struct text_reader *reader, int *values, size_t count)
+{
+	// decode the next count numbers of the file in *values;
+	// return how many of them were found before the end of the file
+	size_t found = 0;
+	while (found < count) {
+		if ((*reader).len - (*reader).pos < READER_LOOKAHEAD &&
+			!(*reader).eof)
+			reader_fill(&(*reader));
+
+		const unsigned char *p = (*reader).buffer + (*reader).pos;
+		const unsigned char *end = (*reader).buffer + (*reader).len;
+
+		// parse as much as possible without refilling
+		const unsigned char *safe = end;
+		if (!(*reader).eof)
+			safe = end - READER_LOOKAHEAD / 2;
+
+		while (found < count && p < safe) {
+			if (!is_number(*p)) {
+				p++;
+				continue;
+			}
+			p = scan_number(p, end, &values[found++]);
 		}
+
+		(*reader).pos = p - (*reader).buffer;
+		if ((*reader).eof && p == end)
+			break;
 	}
+	return (int)found;
 }
 
-void P6_case(FILE **image_file, struct image_data *image)
+void reader_free(struct text_reader *reader)
 {
-	// P6 case (binary file, color image)
+	free((*reader).buffer);
+	(*reader).buffer = NULL;
+}
 
-	// free resources (if another image exists)
-	if ((*image).area)
-		free_image(&(*image), 1);
+static inline size_t pixels_size(int depth, int channels, int lines,
+								 int elems)
+{
+	size_t size = (size_t)depth * channels * lines * elems;
+	return size ? size : PIXEL_ALIGN;
+}
 
-	// read input data until the beginning of the matrix
-	read_before_matrix(&(*image_file), &(*image));
+int aloc_pixels(void **ptr, int depth, int channels, int lines, int elems)
+{
+	// single aligned allocation for a lines x elems matrix
+	// of pixels, with interleaved channels of depth bytes each
+	size_t size = pixels_size(depth, channels, lines, elems);
+
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, PIXEL_ALIGN, size)) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(*ptr));
+		*ptr = NULL;
+		return 0;
+	}
 
-	unsigned char chr = fgetc(*image_file);
+	*ptr = buffer;
+	return 1;
+}
 
-	// check if we're right before the first element in the image matrix
-	if (chr == '\r' || chr == '\n')
-		chr = fgetc(*image_file);
+int aloc_image(struct image_data *image, int lines, int elems)
+{
+	// allocate the pixel buffer of the image, using the
+	// channels and depth already set in the image struct
+	// (or the spare buffer, if it fits without wasting half of it)
+	size_t size = pixels_size((*image).depth, (*image).channels, lines,
+							  elems);
+	if ((*image).spare && (*image).spare_size >= size &&
+		(*image).spare_size / 2 <= size) {
+		(*image).area = (*image).spare;
+		size = (*image).spare_size;
+	} else {
+		free((*image).spare);
+		if (!aloc_pixels(&((*image).area), (*image).depth,
+						 (*image).channels, lines, elems)) {
+			(*image).spare = NULL; (*image).spare_size = 0;
+			return 0;
+		}
+	}
+	(*image).spare = NULL; (*image).spare_size = 0;
 
-	int num_int = 0; // chr -> int transformation
+	(*image).base = (*image).area;
+	(*image).base_size = size;
+	(*image).stride = (size_t)elems * (*image).channels;
+	return 1;
+}
 
-	// allocate memory for the matrix
-	// convention -- color: (*image).area[0..2][i][j], where
-	// 0 - red; 1 - green; 2 - blue
+static inline void *pixel_row(struct image_data *image, int i)
+{
+	// beginning of row i in the pixel buffer
+	return (unsigned char *)(*image).area +
+		   (size_t)i * (*image).stride * (*image).depth;
+}
 
-	int m = (*image).width;
-	int n = (*image).height;
+static inline void *pixel_at(struct image_data *image, int i, int j)
+{
+	// first channel of the pixel (i, j)
+	return (unsigned char *)pixel_row(image, i) +
+		   (size_t)j * (*image).channels * (*image).depth;
+}
 
-	aloc_triple_ptr(&((*image).area), 3, n, m);
+static inline size_t row_bytes(struct image_data *image, int elems)
+{
+	// size in bytes of elems consecutive pixels
+	return (size_t)elems * (*image).channels * (*image).depth;
+}
 
-	for (int i = 0; i < n; i++)
-		for (int j = 0; j < m; j++)
-			for (int k = 0; k < 3; k++) {
-				// next element in the matrix
+static inline int sample_limit(struct image_data *image)
+{
+	// largest value a processed sample may take: 8-bit images keep
+	// the [0, 255] range, 16-bit images go up to max_color
+	if ((*image).depth == 1)
+		return 255;
+	return (*image).max_color;
+}
 
-				num_int = (int)chr;
-				(*image).area[k][i][j] = num_int;
-				chr = fgetc(*image_file);
-			}
+static inline int sample_levels(struct image_data *image)
+{
+	// number of values a stored sample can have
+	return (*image).depth == 1 ? 256 : 65536;
 }
 
-void load_file(char **command, struct image_data *image)
+void set_layout(struct image_data *image, int channels)
 {
-	// LOAD <file> command
+	// after reading the header: pick the sample type from max_color
+	(*image).channels = channels;
+	(*image).depth = (*image).max_color > 255 ? 2 : 1;
+}
 
-	// load in memory the file transmitted as parameter, if it exists; else,
-	// free a possible loaded image
+#define DEFINE_ROW_KERNELS(sfx, type) \
+static inline void load_row_##sfx(const void *src, int *dst, size_t n) \
+{ \
+	/* widen n samples to int */ \
+	const type *s = (const type *)src; \
+	for (size_t j = 0; j < n; j++) \
+		dst[j] = s[j]; \
+} \
+static inline void store_row_##sfx(const int *src, void *dst, size_t n) \
+{ \
+	/* narrow n int values (already in range) to samples */ \
+	type *d = (type *)dst; \
+	for (size_t j = 0; j < n; j++) \
+		d[j] = (type)src[j]; \
+} \
+static inline void count_row_##sfx(const void *src, int *fr, size_t n) \
+{ \
+	/* add the n samples to the frequency vector */ \
+	const type *s = (const type *)src; \
+	for (size_t j = 0; j < n; j++) \
+		fr[s[j]]++; \
+}
+SAMPLE_TYPES(DEFINE_ROW_KERNELS)
 
-	FILE *image_file = fopen(*command + 5, "rt");
-	if (!image_file) {
-		if ((*image).area)
-			free_image(&(*image), 1);
-		printf("Failed to load %s\n", *command + 5);
-		return;
-	}
+// images that don't fit in --max-memory and need random access (ROTATE,
+// FLIP of a streamed image) are kept in a scratch file, as square tiles
+// of TILE_SIZE x TILE_SIZE pixels, each one contiguous; tiles are mapped
+// on use, the least recently used ones being unmapped past the limit
+#define TILE_SIZE 64 // tile bytes stay a multiple of the page size
 
-	// depending on the file type (P2/P3/P5/P6),
-	// we will read the image matrix, element by element
+size_t max_memory; // --max-memory (0 - half of the physical memory)
 
-	char word;
-	word = fgetc(image_file); word = fgetc(image_file);
+size_t memory_limit(void)
+{
+	if (max_memory)
+		return max_memory;
 
-	switch (word) {
-	case '2':
-		P2_case(&image_file, &(*image)); break;
-	case '3':
-		P3_case(&image_file, &(*image)); break;
-	case '5':
-		P5_case(&image_file, &(*image)); break;
-	case '6':
-		P6_case(&image_file, &(*image)); break;
-	}
+	long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page <= 0)
+		return (size_t)1 << 30;
+	return (size_t)pages * page / 2;
+}
 
-	// in LOAD command case, the whole image is selected
-	(*image).x1 = 0; (*image).y1 = 0;
-	(*image).x2 = (*image).width; (*image).y2 = (*image).height;
+struct tile_slot {
+	void *map;        // the mapped tile
+	int tile;         // its index (-1 - free slot)
+	int prev, next;   // list of slots, most recently used first
+};
 
-	printf("Loaded %s\n", *command + 5);
+struct tile_store {
+	int fd; // unlinked scratch file
+	int width, height, tiles_x, tiles_y;
+	size_t pixel, tile_bytes; // bytes of a pixel and of a tile
+	struct tile_slot *slots; int slot_count;
+	int *where; // slot of each tile (-1 - not mapped)
+	int head, tail;
+};
 
-	fclose(image_file);
+void tile_store_free(struct tile_store *store)
+{
+	if (!store)
+		return;
+	for (int s = 0; s < (*store).slot_count; s++)
+		if ((*store).slots[s].map)
+			munmap((*store).slots[s].map, (*store).tile_bytes);
+	free((*store).slots); free((*store).where);
+	close((*store).fd);
+	free(store);
 }
 
-int select_valid(char *token)
+struct tile_store *tile_store_open(struct image_data *image)
 {
-	// used for SELECT command, check if
-	// the token is a valid integer (positive or negative)
-	for (size_t i = 0; i < strlen(token); i++)
-		if (!(('0' <= token[i] && token[i] <= '9') || token[i] == '-'))
-			return 0;
+	// empty store for the image (its dimensions and sample type), in a
+	// file of TMPDIR (or /tmp) removed right away
+	struct tile_store *store;
+	store = (struct tile_store *)calloc(1, sizeof(*store));
+	if (!store) {
+		fprintf(stderr, "Calloc for %s failed\n", var_name(store));
+		return NULL;
+	}
+	(*store).fd = -1;
+	(*store).width = (*image).width; (*store).height = (*image).height;
+	(*store).tiles_x = ((*image).width + TILE_SIZE - 1) / TILE_SIZE;
+	(*store).tiles_y = ((*image).height + TILE_SIZE - 1) / TILE_SIZE;
+	(*store).pixel = row_bytes(&(*image), 1);
+	(*store).tile_bytes = (*store).pixel * TILE_SIZE * TILE_SIZE;
+
+	size_t tiles = (size_t)(*store).tiles_x * (*store).tiles_y;
+	size_t slots = memory_limit() / (*store).tile_bytes;
+	if (slots < 1)
+		slots = 1;
+	if (slots > tiles)
+		slots = tiles;
+	(*store).slot_count = (int)slots;
+
+	const char *dir = getenv("TMPDIR");
+	char *name = (char *)malloc(strlen(dir ? dir : "/tmp") + 32);
+	(*store).slots = (struct tile_slot *)calloc(slots, sizeof(struct tile_slot));
+	(*store).where = (int *)malloc(tiles * sizeof(int));
+	if (!name || !(*store).slots || !(*store).where) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(where));
+		free(name); tile_store_free(store);
+		return NULL;
+	}
 
-	return 1;
+	sprintf(name, "%s/image_editor.XXXXXX", dir ? dir : "/tmp");
+	(*store).fd = mkstemp(name);
+	if ((*store).fd < 0 ||
+		ftruncate((*store).fd, (off_t)(tiles * (*store).tile_bytes))) {
+		fprintf(stderr, "Scratch file %s failed\n", name);
+		if ((*store).fd >= 0)
+			unlink(name);
+		free(name); tile_store_free(store);
+		return NULL;
+	}
+	unlink(name);
+	free(name);
+
+	for (size_t t = 0; t < tiles; t++)
+		(*store).where[t] = -1;
+	for (int s = 0; s < (*store).slot_count; s++) {
+		(*store).slots[s].tile = -1;
+		(*store).slots[s].prev = s - 1;
+		(*store).slots[s].next = s + 1 < (*store).slot_count ? s + 1 : -1;
+	}
+	(*store).head = 0; (*store).tail = (*store).slot_count - 1;
+	return store;
 }
 
-void order_coords(int **coords)
+unsigned char *tile_get(struct tile_store *store, int tile)
 {
-	// used for SELECT command, check if
-	// the coords need to be swapped, in order to have x1 <= x2 and y1 <= y2
-	if ((*coords)[0] > (*coords)[2]) {
-		(*coords)[0] = (*coords)[0] ^ (*coords)[2];
-		(*coords)[2] = (*coords)[0] ^ (*coords)[2];
-		(*coords)[0] = (*coords)[0] ^ (*coords)[2];
+	// the tile, mapped (in the slot least recently used, if it isn't)
+	int s = (*store).where[tile];
+	if (s < 0) {
+		s = (*store).tail;
+		struct tile_slot *slot = &(*store).slots[s];
+		if ((*slot).tile >= 0) {
+			munmap((*slot).map, (*store).tile_bytes);
+			(*store).where[(*slot).tile] = -1;
+		}
+		(*slot).map = mmap(NULL, (*store).tile_bytes, PROT_READ | PROT_WRITE,
+						   MAP_SHARED, (*store).fd,
+						   (off_t)tile * (*store).tile_bytes);
+		if ((*slot).map == MAP_FAILED) {
+			(*slot).map = NULL; (*slot).tile = -1;
+			return NULL;
+		}
+		(*slot).tile = tile;
+		(*store).where[tile] = s;
 	}
 
-	if ((*coords)[1] > (*coords)[3]) {
-		(*coords)[1] = (*coords)[1] ^ (*coords)[3];
-		(*coords)[3] = (*coords)[1] ^ (*coords)[3];
-		(*coords)[1] = (*coords)[1] ^ (*coords)[3];
+	// move the slot to the front of the list
+	if (s != (*store).head) {
+		struct tile_slot *slot = &(*store).slots[s];
+		(*store).slots[(*slot).prev].next = (*slot).next;
+		if ((*slot).next >= 0)
+			(*store).slots[(*slot).next].prev = (*slot).prev;
+		else
+			(*store).tail = (*slot).prev;
+		(*slot).prev = -1; (*slot).next = (*store).head;
+		(*store).slots[(*store).head].prev = s;
+		(*store).head = s;
 	}
+	return (unsigned char *)(*store).slots[s].map;
 }
 
-int valid_coords(int **coords, struct image_data *image)
+int tile_write_row(struct tile_store *store, int i, const unsigned char *row)
 {
-	// used for SELECT command, check if
-	// the coordinates are valid
-	for (int i = 0; i < 4; i++)
-		if ((*coords)[i] < 0)
+	// store row i of the image, a tile row at a time
+	int ty = i / TILE_SIZE, y = i % TILE_SIZE;
+	size_t run = (*store).pixel * TILE_SIZE;
+	for (int tx = 0; tx < (*store).tiles_x; tx++) {
+		unsigned char *tile = tile_get(store, ty * (*store).tiles_x + tx);
+		if (!tile)
 			return 0;
-
-	if ((*coords)[2] > (*image).width || (*coords)[3] > (*image).height)
-		return 0;
-
-	if ((*coords)[0] == (*coords)[2] || (*coords)[1] == (*coords)[3])
-		return 0;
-
+		int left = (*store).width - tx * TILE_SIZE;
+		size_t size = left < TILE_SIZE ? left * (*store).pixel : run;
+		memcpy(tile + y * run, row + tx * run, size);
+	}
 	return 1;
 }
 
-void select_area(char **command, struct image_data *image)
+int tile_read_row(struct tile_store *store, int view[2][3], int i,
+				  int width, unsigned char *row)
 {
-	// SELECT <x1> <y1> <x2> <y2> command
-
-	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
-		return;
+	// row i of the view of the store: pixel (i, j) is the stored pixel
+	// (view[0] . (1, i, j), view[1] . (1, i, j)); consecutive pixels
+	// move by one row or column, so they are copied a run per tile
+	int dy = view[0][2], dx = view[1][2];
+	size_t pixel = (*store).pixel;
+	for (int j = 0; j < width; ) {
+		int y = view[0][0] + view[0][1] * i + dy * j;
+		int x = view[1][0] + view[1][1] * i + dx * j;
+		int ty = y / TILE_SIZE, tx = x / TILE_SIZE;
+		int in_y = y % TILE_SIZE, in_x = x % TILE_SIZE;
+
+		// pixels left in the tile, in the direction of the row
+		int run = dx > 0 ? TILE_SIZE - in_x : dx < 0 ? in_x + 1 :
+				  dy > 0 ? TILE_SIZE - in_y : in_y + 1;
+		if (run > width - j)
+			run = width - j;
+
+		unsigned char *tile = tile_get(store, ty * (*store).tiles_x + tx);
+		if (!tile)
+			return 0;
+		const unsigned char *src = tile + (in_y * TILE_SIZE + in_x) * pixel;
+		ptrdiff_t step = (ptrdiff_t)(dy * TILE_SIZE + dx) * (ptrdiff_t)pixel;
+		for (int k = 0; k < run; k++, src += step)
+			memcpy(row + (size_t)(j + k) * pixel, src, pixel);
+		j += run;
 	}
+	return 1;
+}
 
-	// allocate memory for coordinates
-	// check if the given SELECT is valid
-	char *all_coords = *command + 6;
-	if (all_coords[0] != ' ') {
-		printf("Invalid command\n");
+void stream_free(struct stream_source *stream)
+{
+	// close the file of a streamed image and free the recorded stages
+	if (!stream)
 		return;
-	}
-	char *token; token = strtok(all_coords + 1, " ");
 
-	int *coords; coords = (int *)calloc(5, sizeof(int));
+	if ((*stream).tiles)
+		tile_store_free((*stream).tiles);
+	else
+		fclose((*stream).file);
+	for (int s = 0; s < (*stream).stage_count; s++) {
+		struct stream_stage *stage = &(*stream).stages[s];
+		free((*stage).lut);
+		for (int k = 0; k < (*stage).count; k++)
+			free((*stage).steps[k].kernel);
+		free((*stage).steps);
+	}
+	free((*stream).stages);
+	free(stream);
+}
 
-	// while reading the coords, check each of them to be valid
+void free_image(struct image_data *image, int all)
+{
+	// free all allocated resources for image
+	// (all == 2: keep the pixel buffer as spare, for the next LOAD)
+	if ((*image).map) {
+		munmap((*image).map, (*image).map_size);
+		(*image).map = NULL;
+	} else if (all == 2 && (*image).base) {
+		free((*image).spare);
+		(*image).spare = (*image).base;
+		(*image).spare_size = (*image).base_size;
+	} else {
+		free((*image).base);
+	}
+	(*image).area = NULL;
+	(*image).base = NULL; (*image).base_size = 0;
+
+	// reinitialize variables to null if given, else
+	// keep metadata for a possible new image
+	if (all) {
+		(*image).type[0] = '\0'; (*image).type[1] = '\0';
+
+		(*image).width = 0; (*image).height = 0;
+		(*image).x1 = 0; (*image).y1 = 0;
+		(*image).x2 = 0; (*image).y2 = 0;
+
+		(*image).max_color = 0;
+		(*image).channels = 0; (*image).depth = 0;
+		(*image).stride = 0;
+
+		free((*image).lut);
+		(*image).lut = NULL;
+
+		(*image).remapped = 0;
+		for (int k = 0; k < (*image).apply_count; k++)
+			free((*image).applies[k].kernel);
+		free((*image).applies);
+		(*image).applies = NULL; (*image).apply_count = 0;
+
+		stream_free((*image).stream);
+		(*image).stream = NULL;
+	}
+	if (all == 1) {
+		free((*image).spare);
+		(*image).spare = NULL; (*image).spare_size = 0;
+	}
+}
+
+static inline int image_loaded(struct image_data *image)
+{
+	// pixels in memory, or a streamed file
+	return (*image).area || (*image).stream;
+}
+
+void set_pixels(struct image_data *image, void *buffer, int lines,
+				int elems)
+{
+	// replace the pixels of the image with a lines x elems buffer
+	// allocated by aloc_pixels
+	free_image(&(*image), 0);
+	(*image).area = buffer;
+	(*image).base = buffer;
+	(*image).base_size = (size_t)lines * elems * (*image).channels *
+						 (*image).depth;
+	(*image).stride = (size_t)elems * (*image).channels;
+}
+
+int compact_pixels(struct image_data *image)
+{
+	// replace the buffer or file mapping the image is a view of with
+	// an allocated copy of its pixels only, rows back to back
+	void *copy;
+	int n = (*image).height;
+	if (!aloc_pixels(&copy, (*image).depth, (*image).channels,
+					 n, (*image).width))
+		return 0;
+
+	size_t size = row_bytes(&(*image), (*image).width);
+	for (int i = 0; i < n; i++)
+		memcpy((unsigned char *)copy + i * size, pixel_row(&(*image), i),
+			   size);
+
+	set_pixels(&(*image), copy, n, (*image).width);
+	return 1;
+}
+
+// a view keeping less than a quarter of a buffer larger than this
+// is compacted, so that the rest of the buffer is released
+#define COMPACT_MIN_BYTES (64 << 20)
+
+void release_view_slack(struct image_data *image)
+{
+	size_t held = (*image).map ? (*image).map_size : (*image).base_size;
+	size_t used = row_bytes(&(*image), (*image).width) * (*image).height;
+	if (held > COMPACT_MIN_BYTES && used < held / 4)
+		compact_pixels(&(*image));
+}
+
+int is_mapped_file(struct image_data *image, const char *name)
+{
+	// check if the file is the one the image is mapped from
+	struct stat info;
+	if (!(*image).map || stat(name, &info))
+		return 0;
+
+	return info.st_dev == (*image).map_dev && info.st_ino == (*image).map_ino;
+}
+
+int read_header_number(FILE **image_file)
+{
+	// next number of the header, skipping whitespaces and comments;
+	// the character right after the number is consumed as well
+	int chr = fgetc(*image_file);
+	while (chr != EOF && !is_number(chr)) {
+		// skip comments
+		if (chr == '#')
+			while (chr != EOF && chr != '\n')
+				chr = fgetc(*image_file);
+		chr = fgetc(*image_file);
+	}
+
+	int value = 0;
+	while (chr != EOF && is_number(chr)) {
+		value = value * 10 + (chr - '0');
+		chr = fgetc(*image_file);
+	}
+
+	// "\r\n" after the last header number counts as a single whitespace
+	if (chr == '\r') {
+		chr = fgetc(*image_file);
+		if (chr != '\n' && chr != EOF)
+			ungetc(chr, *image_file);
+	}
+	return value;
+}
+
+void read_before_matrix(FILE **image_file, struct image_data *image)
+{
+	// read the input data from file, stopping at the beginning of the matrix
+
+	// find the image type in the file (P2/P3/P5/P6)
+	rewind(*image_file);
+	for (int i = 0; i < 2; i++)
+		(*image).type[i] = fgetc(*image_file);
+
+	// width, height and max value of a pixel; the single whitespace after
+	// the max value is consumed, so we're right before the first element
+	// of the matrix (which, in binary files, can look like anything)
+	(*image).width = read_header_number(&(*image_file));
+	(*image).height = read_header_number(&(*image_file));
+	(*image).max_color = read_header_number(&(*image_file));
+}
+
+// the matrix of a text file is read in blocks of READER_CHUNK bytes per
+// thread (at most TEXT_BLOCK_CHUNKS of them), each cut in one range per
+// thread, of at least TEXT_RANGE_MIN bytes, at a separator
+#define TEXT_BLOCK_CHUNKS 16
+#define TEXT_RANGE_MIN (64 << 10)
+
+static inline int text_sample(int value, int max_value)
+{
+	// a number of a text matrix, as a sample: clamped to max_value
+	return value < max_value ? value : max_value;
+}
+
+#define DEFINE_TEXT_KERNEL(sfx, type) \
+static size_t decode_text_##sfx(const unsigned char *p, \
+								const unsigned char *limit, \
+								const unsigned char *end, void *dst, \
+								size_t index, size_t total, int max_value) \
+{ \
+	/* store the numbers starting in [p, limit) from sample index on, */ \
+	/* up to total and clamped to max_value; return how many were found */ \
+	type *d = (type *)dst; \
+	size_t found = 0; \
+	while (p < limit && index + found < total) { \
+		if (!is_number(*p)) { \
+			p++; \
+			continue; \
+		} \
+		int value; \
+		p = scan_number(p, end, &value); \
+		d[index + found++] = (type)text_sample(value, max_value); \
+	} \
+	return found; \
+}
+
+SAMPLE_TYPES(DEFINE_TEXT_KERNEL)
+
+size_t count_numbers(const unsigned char *p, const unsigned char *limit)
+{
+	// numbers starting in [p, limit), p being after a separator
+	size_t count = 0;
+	int digit = 0;
+	for (; p < limit; p++) {
+		int next = is_number(*p);
+		count += next & !digit;
+		digit = next;
+	}
+	return count;
+}
+
+struct text_job {
+	struct image_data *image;
+	const unsigned char *block, *end; // block parsed, end of the bytes read
+	size_t *bounds; // range k: block[bounds[k]..bounds[k + 1])
+	size_t *first; // numbers in range k, then index of its first sample
+	size_t total; // samples of the image
+};
+
+void text_count_task(void *arg, int index)
+{
+	struct text_job *job = (struct text_job *)arg;
+	(*job).first[index] = count_numbers((*job).block + (*job).bounds[index],
+										(*job).block +
+										(*job).bounds[index + 1]);
+}
+
+void text_decode_task(void *arg, int index)
+{
+	struct text_job *job = (struct text_job *)arg;
+	struct image_data *image = (*job).image;
+	SAMPLE_CALL(image, decode_text, (*job).block + (*job).bounds[index],
+				(*job).block + (*job).bounds[index + 1], (*job).end,
+				(*image).area, (*job).first[index], (*job).total,
+				(*image).max_color);
+}
+
+void read_text_matrix(FILE **image_file, struct image_data *image)
+{
+	// read the matrix of a text file (P2/P3) in the pixel buffer: each
+	// block is cut in ranges, the numbers of each range are counted in
+	// parallel, which gives the first sample of each, then the ranges
+	// are decoded in parallel (missing elements are black)
+	size_t total = (size_t)(*image).width * (*image).height *
+				   (*image).channels;
+	int threads = pool.size < TEXT_BLOCK_CHUNKS ? pool.size
+												: TEXT_BLOCK_CHUNKS;
+
+	struct text_reader reader;
+	size_t *bounds = (size_t *)malloc((2 * threads + 1) * sizeof(size_t));
+	if (!bounds) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(bounds));
+		free_image(&(*image), 1);
+		return;
+	}
+	if (!reader_init(&reader, *image_file, (size_t)threads * READER_CHUNK)) {
+		free(bounds); free_image(&(*image), 1);
+		return;
+	}
+
+	struct text_job job = {image, NULL, NULL, bounds, bounds + threads + 1,
+						   total};
+	size_t found = 0;
+	while (found < total && !(reader.eof && reader.pos == reader.len)) {
+		if (!reader.eof)
+			reader_fill(&reader);
+
+		// the block ends after the last separator read (a number is
+		// never cut), or at the end of the file
+		size_t len = reader.len - reader.pos;
+		job.block = reader.buffer + reader.pos;
+		job.end = reader.buffer + reader.len;
+		if (!reader.eof)
+			while (len && is_number(job.block[len - 1]))
+				len--;
+
+		int ranges = len / TEXT_RANGE_MIN < (size_t)threads ?
+					 (int)(len / TEXT_RANGE_MIN) : threads;
+		if (ranges <= 1) {
+			found += SAMPLE_CALL(image, decode_text, job.block,
+								 job.block + len, job.end, (*image).area,
+								 found, total, (*image).max_color);
+			reader.pos += len;
+			continue;
+		}
+
+		// range k starts at the first separator after k * len / ranges
+		bounds[0] = 0; bounds[ranges] = len;
+		for (int k = 1; k < ranges; k++) {
+			size_t b = (size_t)k * len / ranges;
+			while (b < len && is_number(job.block[b]))
+				b++;
+			bounds[k] = b;
+		}
+
+		pool_run(&pool, text_count_task, &job, ranges);
+		for (int k = 0; k < ranges; k++) {
+			size_t count = job.first[k];
+			job.first[k] = found;
+			found += count;
+		}
+		pool_run(&pool, text_decode_task, &job, ranges);
+		reader.pos += len;
+	}
+
+	if (found < total)
+		memset((unsigned char *)(*image).area + found * (*image).depth, 0,
+			   (total - found) * (*image).depth);
+	reader_free(&reader); free(bounds);
+}
+
+void P2_case(FILE **image_file, struct image_data *image)
+{
+	// P2 case (text file, grayscale image)
+
+	// free resources (if another image exists)
+	if (image_loaded(&(*image)))
+		free_image(&(*image), 1);
+
+	// read input data until the beginning of the matrix
+	read_before_matrix(&(*image_file), &(*image));
+
+	// allocate memory for the matrix
+	// convention -- grayscale: one sample per pixel
+
+	int m = (*image).width;
+	int n = (*image).height;
+
+	set_layout(&(*image), 1);
+	if (!aloc_image(&(*image), n, m))
+		return;
+
+	read_text_matrix(&(*image_file), &(*image));
+}
+
+void P3_case(FILE **image_file, struct image_data *image)
+{
+	// P3 case (text file, color image)
+
+	// free resources (if another image exists)
+	if (image_loaded(&(*image)))
+		free_image(&(*image), 1);
+
+	// read input data until the beginning of the matrix
+	read_before_matrix(&(*image_file), &(*image));
+
+	// allocate memory for the matrix
+	// convention -- color: three interleaved samples per pixel, where
+	// 0 - red; 1 - green; 2 - blue
+
+	int m = (*image).width;
+	int n = (*image).height;
+
+	set_layout(&(*image), 3);
+	if (!aloc_image(&(*image), n, m))
+		return;
+
+	read_text_matrix(&(*image_file), &(*image));
+}
+
+static inline void msb_row(void *row, size_t samples)
+{
+	// 16-bit samples are stored MSB first in the file: turn the bytes
+	// of the row into samples, in place
+	unsigned char *bytes = (unsigned char *)row;
+	for (size_t j = 0; j < samples; j++)
+		((uint16_t *)row)[j] = (uint16_t)(bytes[2 * j] << 8 |
+										  bytes[2 * j + 1]);
+}
+
+void read_binary_matrix(FILE **image_file, struct image_data *image)
+{
+	// read the whole matrix of a binary file (P5/P6) with bulk reads,
+	// straight into the pixel buffer (the samples are already interleaved
+	// in the file, like in memory)
+
+	int n = (*image).height;
+	size_t size = row_bytes(&(*image), (*image).width);
+
+	// rows are back to back: one read for the whole matrix
+	int lines = n;
+	if ((*image).stride * (*image).depth == size) {
+		size *= n;
+		lines = 1;
+	}
+
+	for (int i = 0; i < lines; i++) {
+		unsigned char *row = (unsigned char *)pixel_row(&(*image), i);
+		size_t read = fread(row, 1, size, *image_file);
+
+		// a truncated file leaves the missing samples black
+		if (read < size)
+			memset(row + read, 0, size - read);
+	}
+	size = row_bytes(&(*image), (*image).width);
+
+	if ((*image).depth == 2)
+		for (int i = 0; i < n; i++)
+			msb_row(pixel_row(&(*image), i), size / 2);
+}
+
+int map_binary_matrix(FILE **image_file, struct image_data *image)
+{
+	// LOAD <file> mmap case: for 8-bit binary files, the matrix in the file
+	// already has the layout of the pixel buffer, so the image points
+	// straight at a private mapping of the file; pages are only copied
+	// (by the kernel) when a command modifies them
+	if ((*image).depth != 1)
+		return 0;
+
+	// we're right before the first element in the image matrix
+	long offset = ftell(*image_file);
+
+	size_t size = row_bytes(&(*image), (*image).width) * (*image).height;
+	struct stat info;
+	if (offset < 0 || fstat(fileno(*image_file), &info) ||
+		(size_t)info.st_size < (size_t)offset + size || size == 0)
+		return 0;
+
+	void *map = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE, fileno(*image_file), 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	(*image).map = map; (*image).map_size = (size_t)info.st_size;
+	(*image).map_dev = info.st_dev; (*image).map_ino = info.st_ino;
+	(*image).area = (unsigned char *)map + offset;
+	(*image).stride = (size_t)(*image).width * (*image).channels;
+	return 1;
+}
+
+void P5_case(FILE **image_file, struct image_data *image, int use_mmap)
+{
+	// P5 case (binary file, grayscale image)
+
+	// free resources (if another image exists)
+	if (image_loaded(&(*image)))
+		free_image(&(*image), 1);
+
+	// read input data until the beginning of the matrix
+	read_before_matrix(&(*image_file), &(*image));
+
+	// allocate memory for the matrix
+	// convention -- grayscale: one sample per pixel
+
+	int m = (*image).width;
+	int n = (*image).height;
+
+	set_layout(&(*image), 1);
+	if (use_mmap && map_binary_matrix(&(*image_file), &(*image)))
+		return;
+
+	if (!aloc_image(&(*image), n, m))
+		return;
+
+	read_binary_matrix(&(*image_file), &(*image));
+}
+
+void P6_case(FILE **image_file, struct image_data *image, int use_mmap)
+{
+	// P6 case (binary file, color image)
+
+	// free resources (if another image exists)
+	if (image_loaded(&(*image)))
+		free_image(&(*image), 1);
+
+	// read input data until the beginning of the matrix
+	read_before_matrix(&(*image_file), &(*image));
+
+	// allocate memory for the matrix
+	// convention -- color: three interleaved samples per pixel, where
+	// 0 - red; 1 - green; 2 - blue
+
+	int m = (*image).width;
+	int n = (*image).height;
+
+	set_layout(&(*image), 3);
+	if (use_mmap && map_binary_matrix(&(*image_file), &(*image)))
+		return;
+
+	if (!aloc_image(&(*image), n, m))
+		return;
+
+	read_binary_matrix(&(*image_file), &(*image));
+}
+
+int stream_open(FILE **image_file, struct image_data *image)
+{
+	// LOAD <file> stream case: only the header is read, the file stays
+	// open for the commands that read the matrix
+	if (image_loaded(&(*image)))
+		free_image(&(*image), 1);
+
+	read_before_matrix(&(*image_file), &(*image));
+	set_layout(&(*image),
+			   (*image).type[1] == '3' || (*image).type[1] == '6' ? 3 : 1);
+
+	struct stream_source *stream;
+	stream = (struct stream_source *)calloc(1, sizeof(*stream));
+	if (!stream) {
+		fprintf(stderr, "Calloc for %s failed\n", var_name(stream));
+		return 0;
+	}
+	(*stream).file = *image_file;
+	(*stream).offset = ftell(*image_file);
+	(*stream).width = (*image).width;
+	(*stream).height = (*image).height;
+	(*image).stream = stream;
+	(*image).stride = (size_t)(*image).width * (*image).channels;
+
+	*image_file = NULL;
+	return 1;
+}
+
+int read_image(const char *file_name, struct image_data *image,
+			   int use_mmap, int use_stream, struct stat *info)
+{
+	// load in memory the file, if it exists (0 - it does not); else,
+	// free a possible loaded image; info - what was read, if given
+	FILE *image_file = fopen(file_name, "rt");
+	if (!image_file) {
+		if (image_loaded(&(*image)))
+			free_image(&(*image), 1);
+		return 0;
+	}
+	if (info && fstat(fileno(image_file), info))
+		memset(info, 0, sizeof(*info));
+
+	// depending on the file type (P2/P3/P5/P6),
+	// we will read the image matrix, element by element
+
+	char word;
+	word = fgetc(image_file); word = fgetc(image_file);
+
+	int supported = word == '2' || word == '3' || word == '5' || word == '6';
+	switch (use_stream && supported ? 's' : word) {
+	case 's':
+		stream_open(&image_file, &(*image)); break;
+	case '2':
+		P2_case(&image_file, &(*image)); break;
+	case '3':
+		P3_case(&image_file, &(*image)); break;
+	case '5':
+		P5_case(&image_file, &(*image), use_mmap); break;
+	case '6':
+		P6_case(&image_file, &(*image), use_mmap); break;
+	}
+
+	// in LOAD command case, the whole image is selected
+	(*image).x1 = 0; (*image).y1 = 0;
+	(*image).x2 = (*image).width; (*image).y2 = (*image).height;
+
+	if (image_file)
+		fclose(image_file);
+	return 1;
+}
+
+int load_options(char *file_name, int *use_mmap, int *use_stream)
+{
+	// optional 'mmap': map 8-bit binary files instead of reading them,
+	// 'stream': read the file, in strips, when the pixels are needed
+	// (cut from the name; 0 - none given)
+	*use_mmap = 0; *use_stream = 0;
+	size_t len = strlen(file_name);
+	if (len > 5 && !strcmp(file_name + len - 5, " mmap")) {
+		file_name[len - 5] = '\0';
+		*use_mmap = 1;
+	} else if (len > 7 && !strcmp(file_name + len - 7, " stream")) {
+		file_name[len - 7] = '\0';
+		*use_stream = 1;
+	}
+	return *use_mmap || *use_stream;
+}
+
+void load_file(char **command, struct image_data *image)
+{
+	// LOAD <file> [mmap|stream] command
+
+	// load in memory the file transmitted as parameter, if it exists; else,
+	// free a possible loaded image
+	char *file_name = *command + 5;
+
+	int use_mmap, use_stream;
+	load_options(file_name, &use_mmap, &use_stream);
+
+	if (read_image(file_name, &(*image), use_mmap, use_stream, NULL))
+		report("Loaded %s\n", file_name);
+	else
+		report("Failed to load %s\n", file_name);
+}
+
+int select_valid(char *token)
+{
+	// used for SELECT command, check if
+	// the token is a valid integer (positive or negative)
+	for (size_t i = 0; i < strlen(token); i++)
+		if (!(('0' <= token[i] && token[i] <= '9') || token[i] == '-'))
+			return 0;
+
+	return 1;
+}
+
+void order_coords(int **coords)
+{
+	// used for SELECT command, check if
+	// the coords need to be swapped, in order to have x1 <= x2 and y1 <= y2
+	if ((*coords)[0] > (*coords)[2]) {
+		(*coords)[0] = (*coords)[0] ^ (*coords)[2];
+		(*coords)[2] = (*coords)[0] ^ (*coords)[2];
+		(*coords)[0] = (*coords)[0] ^ (*coords)[2];
+	}
+
+	if ((*coords)[1] > (*coords)[3]) {
+		(*coords)[1] = (*coords)[1] ^ (*coords)[3];
+		(*coords)[3] = (*coords)[1] ^ (*coords)[3];
+		(*coords)[1] = (*coords)[1] ^ (*coords)[3];
+	}
+}
+
+int valid_coords(int **coords, struct image_data *image)
+{
+	// used for SELECT command, check if
+	// the coordinates are valid
+	for (int i = 0; i < 4; i++)
+		if ((*coords)[i] < 0)
+			return 0;
+
+	if ((*coords)[2] > (*image).width || (*coords)[3] > (*image).height)
+		return 0;
+
+	if ((*coords)[0] == (*coords)[2] || (*coords)[1] == (*coords)[3])
+		return 0;
+
+	return 1;
+}
+
+void select_area(char **command, struct image_data *image)
+{
+	// SELECT <x1> <y1> <x2> <y2> command
+
+	// check for existing image
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
+		return;
+	}
+
+	// allocate memory for coordinates
+	// check if the given SELECT is valid
+	char *all_coords = *command + 6;
+	if (all_coords[0] != ' ') {
+		report("Invalid command\n");
+		return;
+	}
+	char *token; token = command_token(all_coords + 1, " ");
+
+	int *coords; coords = (int *)calloc(5, sizeof(int));
+
+	// while reading the coords, check each of them to be valid
 	for (int i = 0; i < 4; i++)
 		if (token && select_valid(token)) {
 			coords[i] = atoi(token);
-			token = strtok(NULL, " ");
+			token = command_token(NULL, " ");
+		} else {
+			report("Invalid command\n");
+			free(coords);
+			return;
+		}
+	if (token) {
+		report("Invalid command\n");
+		free(coords);
+		return;
+	}
+
+	order_coords(&coords);
+
+	// check if the interval is valid and update image_data struct
+	if (valid_coords(&coords, &(*image))) {
+		(*image).x1 = coords[0]; (*image).y1 = coords[1];
+		(*image).x2 = coords[2]; (*image).y2 = coords[3];
+
+		report("Selected %d %d %d %d\n", coords[0], coords[1],
+			   coords[2], coords[3]);
+		free(coords);
+
+	} else {
+		report("Invalid set of coordinates\n");
+		free(coords);
+	}
+}
+
+void select_all(struct image_data *image)
+{
+	// SELECT ALL command
+
+	// check for existing image
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
+		return;
+	}
+
+	// update coords
+	(*image).x1 = 0; (*image).y1 = 0;
+	(*image).x2 = (*image).width; (*image).y2 = (*image).height;
+
+	report("Selected ALL\n");
+}
+
+void apply_init(struct image_data *image, int *w, int *w_max,
+				int *h, int *h_max)
+{
+	// for APPLY command, initialize coords for the selected area
+	*w = (*image).x1; *w_max = (*image).x2;
+	*h = (*image).y1; *h_max = (*image).y2;
+
+	// margin pixels are not taken into account, only used for
+	// calculating values of their neighbors
+	if (*w == 0)
+		(*w)++;
+	if (*w_max == (*image).width)
+		(*w_max)--;
+
+	if (*h == 0)
+		(*h)++;
+
+	if (*h_max == (*image).height)
+		(*h_max)--;
+}
+
+// 3x3 filters of APPLY: name, coefficients (row by row), divisor and,
+// for separable filters, the column factors c0..c2 (0 - not separable):
+// coefficient (a, b) = c_a * k_b / c0; the divisor is 1 or the
+// (positive) sum of the coefficients
+#define CONV3_FILTERS(X) \
+	X(edge,     -1, -1, -1, -1, 8, -1, -1, -1, -1, 1, 0, 0, 0) \
+	X(sharpen,   0, -1,  0, -1, 5, -1,  0, -1,  0, 1, 0, 0, 0) \
+	X(blur,      1,  1,  1,  1, 1,  1,  1,  1,  1, 9, 1, 1, 1) \
+	X(gaussian,  1,  2,  1,  2, 4,  2,  1,  2,  1, 16, 1, 2, 1)
+
+static inline int clamp_int(int x, int min_value, int max_value)
+{
+	// restrict x value to be in the interval [min_value, max_value]
+	if (x < min_value)
+		return min_value;
+	if (x > max_value)
+		return max_value;
+	return x;
+}
+
+// one kernel per filter, with the coefficients known at compile time;
+// (sum + div / 2) / div is exactly round(sum / div) for a non-negative
+// sum and an odd divisor (no ties) or a divisor of 16 (ties round up).
+// Separable filters sum each column first (blocks of CONV3_BLOCK
+// samples, step at most 3), then the column sums on the row: 6
+// multiply-adds per sample instead of 9, with the same integer sums
+#define CONV3_BLOCK 512
+
+#define DEFINE_CONV3_KERNEL(name, k0, k1, k2, k3, k4, k5, k6, k7, k8, div, \
+							c0, c1, c2) \
+static void conv3_##name(const int *up, const int *mid, const int *down, \
+						 int *out, size_t n, int step, int limit) \
+{ \
+	/* n samples, neighbours are step samples apart on a row */ \
+	for (long b = 0; c0 && b < (long)n; b += CONV3_BLOCK) { \
+		int cols[CONV3_BLOCK + 2 * 3], *col = cols + step; \
+		long m = (long)n - b < CONV3_BLOCK ? (long)n - b : CONV3_BLOCK; \
+		for (long j = -step; j < m + step; j++) \
+			col[j] = c0 * up[b + j] + c1 * mid[b + j] + c2 * down[b + j]; \
+		for (long j = 0; j < m; j++) { \
+			int sum = k0 / (c0 ? c0 : 1) * col[j - step] + \
+					  k1 / (c0 ? c0 : 1) * col[j] + \
+					  k2 / (c0 ? c0 : 1) * col[j + step]; \
+			if (div > 1) \
+				sum = (sum + div / 2) / div; \
+			out[b + j] = clamp_int(sum, 0, limit); \
+		} \
+	} \
+	for (size_t j = 0; !c0 && j < n; j++) { \
+		int sum = k0 * up[j - step] + k1 * up[j] + k2 * up[j + step] + \
+				  k3 * mid[j - step] + k4 * mid[j] + k5 * mid[j + step] + \
+				  k6 * down[j - step] + k7 * down[j] + k8 * down[j + step]; \
+		if (div > 1) \
+			sum = (sum + div / 2) / div; \
+		out[j] = clamp_int(sum, 0, limit); \
+	} \
+}
+CONV3_FILTERS(DEFINE_CONV3_KERNEL)
+
+typedef void (*conv3_kernel)(const int *, const int *, const int *,
+							 int *, size_t, int, int);
+
+conv3_kernel conv3_select(char param)
+{
+	// kernel of the APPLY parameter (first letter of its name)
+	switch (param) {
+	case 'E':
+		return conv3_edge;
+	case 'S':
+		return conv3_sharpen;
+	case 'B':
+		return conv3_blur;
+	case 'G':
+		return conv3_gaussian;
+	}
+	return NULL;
+}
+
+// coefficients of the same filters, for the vectorized 8-bit kernels
+struct conv3_coeffs {
+	int16_t k[9];
+	int div;
+};
+
+#define DEFINE_CONV3_COEFFS(name, k0, k1, k2, k3, k4, k5, k6, k7, k8, div, \
+							c0, c1, c2) \
+static const struct conv3_coeffs coeffs_##name = \
+	{{k0, k1, k2, k3, k4, k5, k6, k7, k8}, div};
+CONV3_FILTERS(DEFINE_CONV3_COEFFS)
+
+const struct conv3_coeffs *conv3_coeffs_select(char param)
+{
+	switch (param) {
+	case 'E':
+		return &coeffs_edge;
+	case 'S':
+		return &coeffs_sharpen;
+	case 'B':
+		return &coeffs_blur;
+	case 'G':
+		return &coeffs_gaussian;
+	}
+	return NULL;
+}
+
+// 8-bit kernel: n samples of out from the rows up, mid and down
+typedef void (*conv3_u8_kernel)(const uint8_t *, const uint8_t *,
+								const uint8_t *, uint8_t *, size_t, int,
+								const struct conv3_coeffs *);
+
+// kernel picked at startup for the CPU (NULL - use the int kernels)
+conv3_u8_kernel conv3_u8_impl;
+
+static void conv3_u8_scalar(const uint8_t *up, const uint8_t *mid,
+							const uint8_t *down, uint8_t *out, size_t n,
+							int step, const struct conv3_coeffs *coeffs)
+{
+	// same arithmetic as the int kernels, used for the samples
+	// left after the last full vector
+	const int16_t *k = (*coeffs).k;
+	int div = (*coeffs).div;
+	for (size_t j = 0; j < n; j++) {
+		int sum = k[0] * up[j - step] + k[1] * up[j] + k[2] * up[j + step] +
+				  k[3] * mid[j - step] + k[4] * mid[j] + k[5] * mid[j + step] +
+				  k[6] * down[j - step] + k[7] * down[j] +
+				  k[8] * down[j + step];
+		if (div > 1)
+			sum = (sum + div / 2) / div;
+		out[j] = (uint8_t)clamp_int(sum, 0, 255);
+	}
+}
+
+// In the vectorized kernels every sum fits in 16 bits (at most 16 * 255
+// in absolute value). Division by 9 of a non-negative x < 32768 is
+// (x * 7282) >> 16 exactly, division by 16 is a shift, and the final
+// clamp to [0, 255] is the saturation of the 16 -> 8 bit packing.
+#define CONV3_DIV9_MAGIC 7282
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static inline __m128i conv3_sse2_sum(const uint8_t *up, const uint8_t *mid,
+									 const uint8_t *down, int step,
+									 const __m128i *k)
+{
+	// weighted sum of 8 samples, as 16-bit values
+	const __m128i zero = _mm_setzero_si128();
+	const uint8_t *src[9] = {up - step, up, up + step,
+							 mid - step, mid, mid + step,
+							 down - step, down, down + step};
+	__m128i sum = zero;
+	for (int t = 0; t < 9; t++) {
+		__m128i x = _mm_loadl_epi64((const __m128i *)src[t]);
+		x = _mm_unpacklo_epi8(x, zero);
+		sum = _mm_add_epi16(sum, _mm_mullo_epi16(x, k[t]));
+	}
+	return sum;
+}
+
+static void conv3_u8_sse2(const uint8_t *up, const uint8_t *mid,
+						  const uint8_t *down, uint8_t *out, size_t n,
+						  int step, const struct conv3_coeffs *coeffs)
+{
+	__m128i k[9];
+	for (int t = 0; t < 9; t++)
+		k[t] = _mm_set1_epi16((*coeffs).k[t]);
+	const __m128i magic = _mm_set1_epi16(CONV3_DIV9_MAGIC);
+	const __m128i four = _mm_set1_epi16(4), eight = _mm_set1_epi16(8);
+
+	size_t j = 0;
+	for (; j + 16 <= n; j += 16) {
+		__m128i lo = conv3_sse2_sum(up + j, mid + j, down + j, step, k);
+		__m128i hi = conv3_sse2_sum(up + j + 8, mid + j + 8, down + j + 8,
+									step, k);
+		if ((*coeffs).div == 9) {
+			lo = _mm_mulhi_epu16(_mm_add_epi16(lo, four), magic);
+			hi = _mm_mulhi_epu16(_mm_add_epi16(hi, four), magic);
+		} else if ((*coeffs).div == 16) {
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, eight), 4);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, eight), 4);
+		}
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(lo, hi));
+	}
+	conv3_u8_scalar(up + j, mid + j, down + j, out + j, n - j, step, coeffs);
+}
+
+__attribute__((target("avx2")))
+static void conv3_u8_avx2(const uint8_t *up, const uint8_t *mid,
+						  const uint8_t *down, uint8_t *out, size_t n,
+						  int step, const struct conv3_coeffs *coeffs)
+{
+	__m256i k[9];
+	for (int t = 0; t < 9; t++)
+		k[t] = _mm256_set1_epi16((*coeffs).k[t]);
+	const __m256i magic = _mm256_set1_epi16(CONV3_DIV9_MAGIC);
+	const __m256i four = _mm256_set1_epi16(4);
+	const __m256i eight = _mm256_set1_epi16(8);
+
+	size_t j = 0;
+	for (; j + 16 <= n; j += 16) {
+		const uint8_t *src[9] = {up + j - step, up + j, up + j + step,
+								 mid + j - step, mid + j, mid + j + step,
+								 down + j - step, down + j, down + j + step};
+
+		// weighted sum of 16 samples, as 16-bit values
+		__m256i sum = _mm256_setzero_si256();
+		for (int t = 0; t < 9; t++) {
+			__m128i x = _mm_loadu_si128((const __m128i *)src[t]);
+			sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(
+								   _mm256_cvtepu8_epi16(x), k[t]));
+		}
+
+		if ((*coeffs).div == 9)
+			sum = _mm256_mulhi_epu16(_mm256_add_epi16(sum, four), magic);
+		else if ((*coeffs).div == 16)
+			sum = _mm256_srli_epi16(_mm256_add_epi16(sum, eight), 4);
+
+		// the packing works on 128-bit lanes: bring the 8 low bytes of
+		// each lane together
+		__m256i packed = _mm256_packus_epi16(sum, sum);
+		packed = _mm256_permute4x64_epi64(packed, 0xD8);
+		_mm_storeu_si128((__m128i *)(out + j),
+						 _mm256_castsi256_si128(packed));
+	}
+	conv3_u8_scalar(up + j, mid + j, down + j, out + j, n - j, step, coeffs);
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+static void conv3_u8_neon(const uint8_t *up, const uint8_t *mid,
+						  const uint8_t *down, uint8_t *out, size_t n,
+						  int step, const struct conv3_coeffs *coeffs)
+{
+	int16x8_t k[9];
+	for (int t = 0; t < 9; t++)
+		k[t] = vdupq_n_s16((*coeffs).k[t]);
+	const uint16x4_t magic = vdup_n_u16(CONV3_DIV9_MAGIC);
+
+	size_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		const uint8_t *src[9] = {up + j - step, up + j, up + j + step,
+								 mid + j - step, mid + j, mid + j + step,
+								 down + j - step, down + j, down + j + step};
+
+		// weighted sum of 8 samples, as 16-bit values
+		int16x8_t sum = vdupq_n_s16(0);
+		for (int t = 0; t < 9; t++) {
+			int16x8_t x = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src[t])));
+			sum = vmlaq_s16(sum, x, k[t]);
+		}
+
+		if ((*coeffs).div == 9) {
+			uint16x8_t x = vreinterpretq_u16_s16(vaddq_s16(sum,
+															 vdupq_n_s16(4)));
+			uint16x4_t lo = vshrn_n_u32(vmull_u16(vget_low_u16(x), magic), 16);
+			uint16x4_t hi = vshrn_n_u32(vmull_u16(vget_high_u16(x), magic),
+										16);
+			sum = vreinterpretq_s16_u16(vcombine_u16(lo, hi));
+		} else if ((*coeffs).div == 16) {
+			sum = vshrq_n_s16(vaddq_s16(sum, vdupq_n_s16(8)), 4);
+		}
+		vst1_u8(out + j, vqmovun_s16(sum));
+	}
+	conv3_u8_scalar(up + j, mid + j, down + j, out + j, n - j, step, coeffs);
+}
+#endif
+
+void init_cpu_kernels(void)
+{
+	// pick the vectorized kernels supported by the CPU (checked once,
+	// at startup); they give the same results as the int kernels
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		conv3_u8_impl = conv3_u8_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		conv3_u8_impl = conv3_u8_sse2;
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+		conv3_u8_impl = conv3_u8_neon;
+#endif
+}
+
+// APPLY <F1> [F2 ...] on the rows [h, h_max) of the selection: the
+// filters run as a chain of stages in one sweep, each stage keeping its
+// last three rows (a ring) for the next one; the rows are split into
+// bands that run on the thread pool, the rows of the other bands a band
+// reads being copied before any band starts (they are overwritten)
+struct apply_job {
+	struct image_data *image;
+	const char *params; int count; // the filters, in order
+	int w, w_max, h, h_max;
+	int bands;
+	int margin;  // rows read above and below a band
+	int col0;    // first column read
+	size_t span; // samples read from a row
+	int vector;  // 8-bit image, vectorized kernels: rows kept as bytes
+	void *edges; // per band: the margin rows above it and below it
+	int failed;  // a band could not allocate its rows
+};
+
+static inline void band_rows(struct apply_job *job, int band, int *from,
+							 int *to)
+{
+	long rows = (*job).h_max - (*job).h;
+	*from = (*job).h + (int)(rows * band / (*job).bands);
+	*to = (*job).h + (int)(rows * (band + 1) / (*job).bands);
+}
+
+static inline void *band_edge(struct apply_job *job, int band, int k)
+{
+	// k < margin: row from - margin + k, else row to + k - margin
+	size_t bytes = (*job).span * (*(*job).image).depth;
+	return (char *)(*job).edges +
+		   ((size_t)band * 2 * (*job).margin + k) * bytes;
+}
+
+static inline const void *band_source(struct apply_job *job, int band,
+									  int from, int to, int t)
+{
+	// original values of row t (from column col0), as read by a band:
+	// the rows of other bands inside the selection come from the copies
+	if (t >= (*job).h && t < from)
+		return band_edge(job, band, t - (from - (*job).margin));
+	if (t >= to && t < (*job).h_max)
+		return band_edge(job, band, (*job).margin + t - to);
+	return pixel_at((*job).image, t, (*job).col0);
+}
+
+struct apply_band_rows {
+	struct apply_job *job;
+	unsigned char *rows; // 3 rows per stage, stage 0 - source rows
+	unsigned char *outer[2]; // rows h - 1 and h_max (never modified)
+	size_t row_size;
+};
+
+static inline void *stage_row(struct apply_band_rows *band, int s, int r)
+{
+	// row r of stage s (the result of the first s filters); outside
+	// the selection, the rows keep their values in every stage
+	struct apply_job *job = (*band).job;
+	if (r < (*job).h)
+		return (*band).outer[0];
+	if (r >= (*job).h_max)
+		return (*band).outer[1];
+	return (*band).rows + (3 * (size_t)s + r % 3) * (*band).row_size;
+}
+
+static inline void load_band_row(struct apply_job *job, const void *src,
+								 void *dst)
+{
+	if ((*job).vector)
+		memcpy(dst, src, (*job).span);
+	else
+		SAMPLE_CALL((*job).image, load_row, src, (int *)dst, (*job).span);
+}
+
+void apply_band(void *arg, int band)
+{
+	struct apply_job *job = (struct apply_job *)arg;
+	struct image_data *image = (*job).image;
+	int n = (*job).count, c = (*image).channels, w = (*job).w;
+	int h = (*job).h, h_max = (*job).h_max;
+	int limit = sample_limit(&(*image));
+
+	int from, to;
+	band_rows(job, band, &from, &to);
+
+	size_t es = (*job).vector ? 1 : sizeof(int);
+	size_t samples = (*job).span - 2 * c;
+	struct apply_band_rows ring = {job, NULL, {NULL, NULL},
+								   (*job).span * es};
+
+	// stage rows, then the two rows around the selection
+	ring.rows = (unsigned char *)malloc((3 * (size_t)(n + 1) + 2) *
+										ring.row_size);
+	if (!ring.rows) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(rows));
+		__atomic_store_n(&(*job).failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring.outer[0] = ring.rows + 3 * (size_t)(n + 1) * ring.row_size;
+	ring.outer[1] = ring.outer[0] + ring.row_size;
+	load_band_row(job, pixel_at(&(*image), h - 1, w - 1), ring.outer[0]);
+	load_band_row(job, pixel_at(&(*image), h_max, w - 1), ring.outer[1]);
+
+	// source row t enters stage 0, then stage s computes its row t - s;
+	// stage s is needed on the rows [from - (n - s), to + (n - s))
+	for (int t = from - n; t < to + n; t++) {
+		if (h <= t && t < h_max)
+			load_band_row(job, band_source(job, band, from, to, t),
+						  stage_row(&ring, 0, t));
+
+		for (int s = 1; s <= n; s++) {
+			int r = t - s;
+			if (r < h || r >= h_max || r < from - (n - s) ||
+				r >= to + (n - s))
+				continue;
+
+			unsigned char *up = stage_row(&ring, s - 1, r - 1);
+			unsigned char *mid = stage_row(&ring, s - 1, r);
+			unsigned char *down = stage_row(&ring, s - 1, r + 1);
+			unsigned char *out = stage_row(&ring, s, r);
+
+			// the margin pixels keep their values
+			memcpy(out, mid, c * es);
+			memcpy(out + (c + samples) * es, mid + (c + samples) * es,
+				   c * es);
+
+			char param = (*job).params[s - 1];
+			if ((*job).vector)
+				conv3_u8_impl(up + c, mid + c, down + c, out + c, samples, c,
+							  conv3_coeffs_select(param));
+			else
+				conv3_select(param)((int *)up + c, (int *)mid + c,
+									(int *)down + c, (int *)out + c,
+									samples, c, limit);
+
+			// the last stage gives the new pixels (i, w..w_max - 1)
+			if (s == n) {
+				void *dst = pixel_at(&(*image), r, w);
+				if ((*job).vector)
+					memcpy(dst, out + c, samples);
+				else
+					SAMPLE_CALL(image, store_row, (int *)out + c, dst,
+								samples);
+			}
+		}
+	}
+
+	free(ring.rows);
+}
+
+#define APPLY_BAND_ROWS 16 // fewest rows worth a band of their own
+
+int apply_run(struct apply_job *job, void (*task)(void *, int))
+{
+	// split the rows of the job into bands, copy the rows each band
+	// reads from the other ones, then run the bands on the pool
+	// (0 - some rows could not be computed)
+
+	// a few bands per thread, so that an uneven split still keeps
+	// every thread busy; the result does not depend on their number
+	int rows = (*job).h_max - (*job).h;
+	int min_rows = APPLY_BAND_ROWS;
+	if (min_rows < 2 * (*job).margin)
+		min_rows = 2 * (*job).margin;
+
+	(*job).bands = 1;
+	if (pool.size > 1 && rows / min_rows > 1) {
+		(*job).bands = 4 * pool.size;
+		if ((*job).bands > rows / min_rows)
+			(*job).bands = rows / min_rows;
+	}
+
+	struct image_data *image = (*job).image;
+	size_t bytes = (*job).span * (*image).depth;
+	(*job).edges = malloc(2 * (size_t)(*job).margin * (*job).bands * bytes);
+	if (!(*job).edges) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(edges));
+		return 0;
+	}
+	for (int band = 0; band < (*job).bands; band++) {
+		int from, to;
+		band_rows(job, band, &from, &to);
+		for (int k = 0; k < (*job).margin; k++) {
+			int above = from - (*job).margin + k, below = to + k;
+			if (above >= (*job).h)
+				memcpy(band_edge(job, band, k),
+					   pixel_at(&(*image), above, (*job).col0), bytes);
+			if (below < (*job).h_max)
+				memcpy(band_edge(job, band, (*job).margin + k),
+					   pixel_at(&(*image), below, (*job).col0), bytes);
+		}
+	}
+
+	pool_run(&pool, task, job, (*job).bands);
+
+	free((*job).edges);
+	return !(*job).failed;
+}
+
+int apply_exec(struct image_data *image, const char *params, int count)
+{
+	// check which pixels will be modified (margins not taken)
+	int w, w_max, h, h_max;
+	apply_init(&(*image), &w, &w_max, &h, &h_max);
+	if (w >= w_max || h >= h_max || count < 1)
+		return 1;
+
+	struct apply_job job = {&(*image), params, count, w, w_max, h, h_max, 1,
+							count, w - 1,
+							(size_t)(w_max - w + 2) * (*image).channels,
+							(*image).depth == 1 && conv3_u8_impl, NULL, 0};
+	return apply_run(&job, apply_band);
+}
+
+// BOX_BLUR <r>: mean of the (2r + 1) x (2r + 1) pixels around each one,
+// with the coordinates outside the image clamped to its edges; the sums
+// are kept per row (horizontal running sums, for the last 2r + 1 rows)
+// and per column (vertical running sum of those), so each pixel costs
+// the same for any radius
+#define BOX_RADIUS_MAX 4096
+
+static inline int clamp_index(int x, int n)
+{
+	return x < 0 ? 0 : x >= n ? n - 1 : x;
+}
+
+static void box_row_sums(struct apply_job *job, int band, int from, int to,
+						 int k, int *line, int32_t *sums)
+{
+	// horizontal sums of row k (clamped) for the columns [w, w_max)
+	struct image_data *image = (*job).image;
+	int r = (*job).margin, c = (*image).channels, width = (*image).width;
+	int t = clamp_index(k, (*image).height);
+
+	SAMPLE_CALL(image, load_row, band_source(job, band, from, to, t), line,
+				(*job).span);
+
+	for (int ch = 0; ch < c; ch++) {
+		int32_t sum = 0;
+		for (int q = (*job).w - r; q <= (*job).w + r; q++)
+			sum += line[clamp_index(q, width) * c + ch];
+
+		int32_t *out = sums + ch;
+		for (int j = (*job).w; j < (*job).w_max; j++) {
+			*out = sum;
+			out += c;
+			sum += line[clamp_index(j + r + 1, width) * c + ch] -
+				   line[clamp_index(j - r, width) * c + ch];
+		}
+	}
+}
+
+void box_band(void *arg, int band)
+{
+	struct apply_job *job = (struct apply_job *)arg;
+	struct image_data *image = (*job).image;
+	int r = (*job).margin, win = 2 * r + 1;
+	size_t n = (size_t)((*job).w_max - (*job).w) * (*image).channels;
+	int64_t area = (int64_t)win * win;
+
+	int from, to;
+	band_rows(job, band, &from, &to);
+
+	// ring of the horizontal sums of rows i - r..i + r (row k in slot
+	// k mod win), their vertical sums, a source row and a result row
+	int32_t *sums = (int32_t *)malloc((size_t)win * n * sizeof(int32_t));
+	int64_t *col = (int64_t *)calloc(n, sizeof(int64_t));
+	int *line = (int *)malloc(((*job).span + n) * sizeof(int));
+	if (!sums || !col || !line) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(sums));
+		free(sums); free(col); free(line);
+		__atomic_store_n(&(*job).failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	int *out = line + (*job).span;
+
+	for (int k = from - r; k <= from + r; k++) {
+		int32_t *slot = sums + (size_t)((k % win + win) % win) * n;
+		box_row_sums(job, band, from, to, k, line, slot);
+		for (size_t l = 0; l < n; l++)
+			col[l] += slot[l];
+	}
+
+	for (int i = from; i < to; i++) {
+		for (size_t l = 0; l < n; l++)
+			out[l] = (int)((col[l] + area / 2) / area);
+		SAMPLE_CALL(image, store_row, out, pixel_at(&(*image), i, (*job).w),
+					n);
+
+		// slide the window one row down: row i + r + 1 takes the slot
+		// of row i - r
+		if (i + 1 == to)
+			break;
+		int32_t *slot = sums + (size_t)(((i - r) % win + win) % win) * n;
+		for (size_t l = 0; l < n; l++)
+			col[l] -= slot[l];
+		box_row_sums(job, band, from, to, i + r + 1, line, slot);
+		for (size_t l = 0; l < n; l++)
+			col[l] += slot[l];
+	}
+
+	free(sums); free(col); free(line);
+}
+
+int box_exec(struct image_data *image, int r)
+{
+	int w, w_max, h, h_max;
+	apply_init(&(*image), &w, &w_max, &h, &h_max);
+	if (w >= w_max || h >= h_max || r < 1)
+		return 1;
+
+	// whole rows are read, the columns being clamped to the image
+	struct apply_job job = {&(*image), NULL, 0, w, w_max, h, h_max, 1,
+							r, 0, (size_t)(*image).width * (*image).channels,
+							0, NULL, 0};
+	return apply_run(&job, box_band);
+}
+
+void gaussian_widths(double sigma, int widths[3])
+{
+	// GAUSSIAN <sigma>: three box blurs, with widths chosen so that
+	// their variance is the closest to sigma^2 (the two odd widths
+	// around the ideal sqrt(12 sigma^2 / 3 + 1))
+	int wl = (int)floor(sqrt(4 * sigma * sigma + 1));
+	if (wl % 2 == 0)
+		wl--;
+	int m = (int)lround((12 * sigma * sigma - 3.0 * wl * wl - 12.0 * wl - 9) /
+						(-4.0 * wl - 4));
+
+	for (int pass = 0; pass < 3; pass++)
+		widths[pass] = pass < m ? wl : wl + 2;
+}
+
+int gaussian_exec(struct image_data *image, double sigma)
+{
+	int widths[3];
+	gaussian_widths(sigma, widths);
+	for (int pass = 0; pass < 3; pass++)
+		if (widths[pass] > 1 && !box_exec(&(*image), widths[pass] / 2))
+			return 0;
+	return 1;
+}
+
+// KERNEL <file>: user-supplied N x N kernel (N odd), normalized by the
+// sum of its coefficients (if not 0); like BOX_BLUR, coordinates outside
+// the image are clamped to its edges. The rows are split in bands as for
+// APPLY (see apply_run); small kernels are applied directly, large ones
+// through FFT: each band is cut in tiles, each one convolved (with its
+// margin) in an M x M transform, M a power of two (overlap-save). Besides
+// the margins of the bands, a band keeps at most a tile of rows, so the
+// memory used grows with the width of the selection, not its height
+#define KERNEL_SIZE_MAX 255
+#define KERNEL_DIRECT_TAPS 64 // most products per sample applied directly
+#define KERNEL_ROUND_EPS 1e-6
+#define KERNEL_RANK_EPS 1e-9
+
+struct conv_kernel {
+	int n;
+	int separable; // k = col x row: a column pass, then a row pass
+	double *col, *row; // factors (in k, after the coefficients)
+	double k[]; // n x n coefficients, row by row, normalized
+};
+
+void kernel_factor(struct conv_kernel *kernel)
+{
+	// rank 1 check: with (p, q) the largest coefficient, the kernel is
+	// separable if every coefficient (a, b) is k(a, q) * k(p, b) / k(p, q)
+	int n = (*kernel).n, p = 0, q = 0;
+	const double *k = (*kernel).k;
+	for (int i = 0; i < n * n; i++)
+		if (fabs(k[i]) > fabs(k[p * n + q])) {
+			p = i / n; q = i % n;
+		}
+
+	double pivot = k[p * n + q];
+	(*kernel).separable = pivot != 0;
+	for (int a = 0; a < n && (*kernel).separable; a++) {
+		(*kernel).col[a] = k[a * n + q];
+		(*kernel).row[a] = k[p * n + a] / pivot;
+		for (int b = 0; b < n; b++)
+			if (fabs(k[a * n + b] - k[a * n + q] * k[p * n + b] / pivot) >
+				KERNEL_RANK_EPS * fabs(pivot))
+				(*kernel).separable = 0;
+	}
+}
+
+struct conv_kernel *kernel_load(const char *name)
+{
+	// text file: N, then the N x N coefficients, row by row
+	FILE *file = fopen(name, "rt");
+	if (!file)
+		return NULL;
+
+	int n;
+	if (fscanf(file, "%d", &n) != 1 || n < 1 || n % 2 == 0 ||
+		n > KERNEL_SIZE_MAX) {
+		fclose(file);
+		return NULL;
+	}
+
+	struct conv_kernel *kernel;
+	kernel = (struct conv_kernel *)malloc(sizeof(struct conv_kernel) +
+										  (size_t)(n + 2) * n * sizeof(double));
+	if (!kernel) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(kernel));
+		fclose(file);
+		return NULL;
+	}
+	(*kernel).n = n;
+	(*kernel).col = (*kernel).k + n * n;
+	(*kernel).row = (*kernel).col + n;
+
+	double sum = 0;
+	for (int i = 0; i < n * n; i++) {
+		if (fscanf(file, "%lf", &(*kernel).k[i]) != 1) {
+			free(kernel); fclose(file);
+			return NULL;
+		}
+		sum += (*kernel).k[i];
+	}
+	fclose(file);
+
+	if (fabs(sum) > 1e-9)
+		for (int i = 0; i < n * n; i++)
+			(*kernel).k[i] /= sum;
+
+	kernel_factor(kernel);
+	return kernel;
+}
+
+struct kernel_job {
+	struct apply_job rows; // the bands of rows (first: given to the tasks)
+	const struct conv_kernel *kernel;
+	int size, tile;        // FFT: transform size M, output tile M - N + 1
+	double *twiddles;      // e^(-2 pi i k / M), k < M / 2 (re, im pairs)
+	double *spectrum;      // transform of the (flipped) kernel, M x M
+};
+
+static inline const int *kernel_pixel(struct kernel_job *job, const int *line,
+									  int x)
+{
+	// pixel of column x (clamped) in a row loaded from column col0
+	struct image_data *image = (*job).rows.image;
+	return line + (size_t)(clamp_index(x, (*image).width) -
+						   (*job).rows.col0) * (*image).channels;
+}
+
+static inline int kernel_round(struct kernel_job *job, double value)
+{
+	// rounded and clamped result, as for the 3x3 filters (halves are
+	// rounded up even if the FFT gives them slightly below)
+	return clamp_int((int)floor(value + 0.5 + KERNEL_ROUND_EPS), 0,
+					 sample_limit((*job).rows.image));
+}
+
+static inline void kernel_store(struct kernel_job *job, int y, int x, int ch,
+								double value)
+{
+	struct image_data *image = (*job).rows.image;
+	int v = kernel_round(job, value);
+	if ((*image).depth == 1)
+		((uint8_t *)pixel_at(image, y, x))[ch] = (uint8_t)v;
+	else
+		((uint16_t *)pixel_at(image, y, x))[ch] = (uint16_t)v;
+}
+
+void kernel_band(void *arg, int band)
+{
+	// direct convolution of a band of rows: the N source rows read by
+	// the current row are kept (clamped) as doubles in a ring, so that
+	// the inner loop is only multiplications and additions; a separable
+	// kernel first sums them by column (2N products per sample, not N^2);
+	// a row of the band is read before it is written
+	struct kernel_job *job = (struct kernel_job *)arg;
+	struct apply_job *rows = &(*job).rows;
+	struct image_data *image = (*rows).image;
+	const struct conv_kernel *kernel = (*job).kernel;
+	int n = (*kernel).n, r = n / 2;
+	int c = (*image).channels;
+	const double *k = (*kernel).k;
+
+	int from, to;
+	band_rows(rows, band, &from, &to);
+
+	int cols = (*rows).w_max - (*rows).w;
+	size_t width = (size_t)(cols + 2 * r) * c;
+	double *lines = (double *)malloc((n + 1) * width * sizeof(double));
+	int *line = (int *)malloc((*rows).span * sizeof(int));
+	if (!lines || !line) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(lines));
+		free(lines); free(line);
+		__atomic_store_n(&(*rows).failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	double *sums = lines + n * width; // column sums (separable kernel)
+
+	// source row t is in the slot (t - from + r) mod n of the ring
+	for (int t = from - r; t < to + r; t++) {
+		double *slot = lines + (size_t)((t - from + r) % n) * width;
+		SAMPLE_CALL(image, load_row,
+					band_source(rows, band, from, to,
+								clamp_index(t, (*image).height)),
+					line, (*rows).span);
+		for (int v = 0; v < cols + 2 * r; v++) {
+			const int *px = kernel_pixel(job, line, (*rows).w + v - r);
+			for (int ch = 0; ch < c; ch++)
+				slot[(size_t)v * c + ch] = px[ch];
+		}
+		if (t < from + r)
+			continue;
+
+		// the ring holds the rows [i - r, i + r]
+		int i = t - r;
+		double *ring[KERNEL_SIZE_MAX];
+		for (int a = 0; a < n; a++)
+			ring[a] = lines + (size_t)((i + a - from) % n) * width;
+
+		if ((*kernel).separable) {
+			for (size_t v = 0; v < width; v++) {
+				double sum = 0;
+				for (int a = 0; a < n; a++)
+					sum += (*kernel).col[a] * ring[a][v];
+				sums[v] = sum;
+			}
+			for (int j = 0; j < cols; j++)
+				for (int ch = 0; ch < c; ch++) {
+					double sum = 0;
+					const double *line = sums + (size_t)j * c + ch;
+					for (int b = 0; b < n; b++)
+						sum += (*kernel).row[b] * line[b * c];
+					kernel_store(job, i, (*rows).w + j, ch, sum);
+				}
+			continue;
+		}
+
+		for (int j = 0; j < cols; j++)
+			for (int ch = 0; ch < c; ch++) {
+				double sum = 0;
+				for (int a = 0; a < n; a++) {
+					const double *line = ring[a] + (size_t)j * c + ch;
+					for (int b = 0; b < n; b++)
+						sum += k[a * n + b] * line[b * c];
+				}
+				kernel_store(job, i, (*rows).w + j, ch, sum);
+			}
+	}
+
+	free(lines); free(line);
+}
+
+static void fft_run(double *data, int n, size_t step, const double *twiddles,
+					int inverse)
+{
+	// in-place radix-2 FFT of n complex values (re, im pairs), each one
+	// step values from the previous (step 1 - a row, step M - a column)
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double *a = data + 2 * i * step, *b = data + 2 * j * step;
+			double re = a[0], im = a[1];
+			a[0] = b[0]; a[1] = b[1];
+			b[0] = re; b[1] = im;
+		}
+	}
+
+	for (int len = 2; len <= n; len <<= 1) {
+		int half = len / 2, stride = n / len;
+		for (int i = 0; i < n; i += len)
+			for (int l = 0; l < half; l++) {
+				double wr = twiddles[2 * l * stride];
+				double wi = twiddles[2 * l * stride + 1];
+				if (inverse)
+					wi = -wi;
+				double *a = data + 2 * (i + l) * step;
+				double *b = data + 2 * (i + l + half) * step;
+				double xr = b[0] * wr - b[1] * wi;
+				double xi = b[0] * wi + b[1] * wr;
+				b[0] = a[0] - xr; b[1] = a[1] - xi;
+				a[0] += xr; a[1] += xi;
+			}
+	}
+}
+
+static void fft_2d(double *data, int m, const double *twiddles, int inverse)
+{
+	// M x M transform: rows, then columns (the inverse is not scaled)
+	for (int i = 0; i < m; i++)
+		fft_run(data + 2 * (size_t)i * m, m, 1, twiddles, inverse);
+	for (int j = 0; j < m; j++)
+		fft_run(data + 2 * (size_t)j, m, m, twiddles, inverse);
+}
+
+static inline const void *kernel_piece_row(struct kernel_job *job, int band,
+											int from, int to, int y0,
+											const unsigned char *above, int t)
+{
+	// original values of row t (clamped) for the piece of a band that
+	// starts at row y0: the rows of the band above it are in above
+	struct apply_job *rows = &(*job).rows;
+	struct image_data *image = (*rows).image;
+	t = clamp_index(t, (*image).height);
+	if (t >= from && t < y0)
+		return above + (size_t)(t - y0 + (*rows).margin) * (*rows).span *
+			   (*image).depth;
+	return band_source(rows, band, from, to, t);
+}
+
+void kernel_tiles(void *arg, int band)
+{
+	// a band through FFT, cut in pieces of at most a tile of rows, each
+	// piece in tiles across the selection; two channels go through one
+	// transform, as its real and imaginary parts (the kernel is real).
+	// A piece is written once all its tiles are computed, the original
+	// values of its last r rows being kept for the next piece
+	struct kernel_job *job = (struct kernel_job *)arg;
+	struct apply_job *rows = &(*job).rows;
+	struct image_data *image = (*rows).image;
+	int m = (*job).size, tile = (*job).tile, r = (*rows).margin;
+	int c = (*image).channels, cols = (*rows).w_max - (*rows).w;
+	size_t bytes = (*rows).span * (*image).depth;
+
+	int from, to;
+	band_rows(rows, band, &from, &to);
+	int pieces = (to - from + tile - 1) / tile;
+
+	double *data = (double *)malloc(2 * (size_t)m * m * sizeof(double));
+	int *line = (int *)malloc((*rows).span * sizeof(int));
+	int *out = (int *)malloc((size_t)tile * cols * c * sizeof(int));
+	unsigned char *above = (unsigned char *)malloc(r * bytes);
+	if (!data || !line || !out || !above) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(data));
+		free(data); free(line); free(out); free(above);
+		__atomic_store_n(&(*rows).failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (int p = 0; p < pieces; p++) {
+		int y0 = from + (int)((long)(to - from) * p / pieces);
+		int y1 = from + (int)((long)(to - from) * (p + 1) / pieces);
+
+		for (int x0 = (*rows).w; x0 < (*rows).w_max; x0 += tile) {
+			int w = (*rows).w_max - x0 < tile ? (*rows).w_max - x0 : tile;
+			for (int ch = 0; ch < c; ch += 2) {
+				// the tile with its margin, the rest of the transform
+				// being 0
+				memset(data, 0, 2 * (size_t)m * m * sizeof(double));
+				for (int u = 0; u < y1 - y0 + 2 * r; u++) {
+					SAMPLE_CALL(image, load_row,
+								kernel_piece_row(job, band, from, to, y0,
+												 above, y0 - r + u),
+								line, (*rows).span);
+					for (int v = 0; v < w + 2 * r; v++) {
+						const int *px = kernel_pixel(job, line, x0 - r + v);
+						double *cell = data + 2 * ((size_t)u * m + v);
+						cell[0] = px[ch];
+						if (ch + 1 < c)
+							cell[1] = px[ch + 1];
+					}
+				}
+
+				fft_2d(data, m, (*job).twiddles, 0);
+				for (size_t l = 0; l < (size_t)m * m; l++) {
+					double *a = data + 2 * l, *b = (*job).spectrum + 2 * l;
+					double re = a[0] * b[0] - a[1] * b[1];
+					double im = a[0] * b[1] + a[1] * b[0];
+					a[0] = re; a[1] = im;
+				}
+				fft_2d(data, m, (*job).twiddles, 1);
+
+				// the pixel (y0 + i, x0 + j) is at (i + r, j + r)
+				double scale = 1.0 / ((double)m * m);
+				for (int i = 0; i < y1 - y0; i++)
+					for (int j = 0; j < w; j++) {
+						double *cell = data + 2 * ((size_t)(i + r) * m +
+												   j + r);
+						int *o = out + ((size_t)i * cols + x0 - (*rows).w +
+										j) * c + ch;
+						o[0] = kernel_round(job, cell[0] * scale);
+						if (ch + 1 < c)
+							o[1] = kernel_round(job, cell[1] * scale);
+					}
+			}
+		}
+
+		if (p + 1 < pieces)
+			for (int k = 0; k < r; k++)
+				memcpy(above + k * bytes,
+					   pixel_at(&(*image), y1 - r + k, (*rows).col0), bytes);
+		for (int i = y0; i < y1; i++)
+			SAMPLE_CALL(image, store_row, out + (size_t)(i - y0) * cols * c,
+						pixel_at(&(*image), i, (*rows).w), (size_t)cols * c);
+	}
+
+	free(data); free(line); free(out); free(above);
+}
+
+int kernel_fft_init(struct kernel_job *job)
+{
+	// transform size: a power of two, at least 4N, so that most of each
+	// transform gives output pixels
+	const struct conv_kernel *kernel = (*job).kernel;
+	int n = (*kernel).n, r = n / 2, m = 32;
+	while (m < 4 * n)
+		m <<= 1;
+	(*job).size = m;
+	(*job).tile = m - n + 1;
+
+	(*job).twiddles = (double *)malloc((size_t)m * sizeof(double));
+	(*job).spectrum = (double *)calloc(2 * (size_t)m * m, sizeof(double));
+	if (!(*job).twiddles || !(*job).spectrum) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(spectrum));
+		return 0;
+	}
+	double angle = -2 * acos(-1.0) / m;
+	for (int l = 0; l < m / 2; l++) {
+		(*job).twiddles[2 * l] = cos(angle * l);
+		(*job).twiddles[2 * l + 1] = sin(angle * l);
+	}
+
+	// coefficient (a, b) is applied to the pixel (a - r, b - r) away:
+	// as a convolution, it goes at ((r - a) mod M, (r - b) mod M)
+	for (int a = 0; a < n; a++)
+		for (int b = 0; b < n; b++) {
+			size_t u = (size_t)((r - a + m) % m), v = (size_t)((r - b + m) % m);
+			(*job).spectrum[2 * (u * m + v)] = (*kernel).k[a * n + b];
+		}
+	fft_2d((*job).spectrum, m, (*job).twiddles, 0);
+	return 1;
+}
+
+int kernel_exec(struct image_data *image, const struct conv_kernel *kernel)
+{
+	int w, w_max, h, h_max;
+	apply_init(&(*image), &w, &w_max, &h, &h_max);
+	if (w >= w_max || h >= h_max)
+		return 1;
+
+	// the rows are read from the first column to the last one the
+	// kernel reads, the bands copying the rows of the others they read
+	int r = (*kernel).n / 2;
+	int x_lo = w - r > 0 ? w - r : 0;
+	int x_hi = w_max + r < (*image).width ? w_max + r : (*image).width;
+	struct kernel_job job = {{&(*image), NULL, 0, w, w_max, h, h_max, 1, r,
+							  x_lo, (size_t)(x_hi - x_lo) * (*image).channels,
+							  0, NULL, 0},
+							 kernel, 0, 0, NULL, NULL};
+
+	int ok;
+	int taps = (*kernel).separable ? 2 * (*kernel).n :
+									 (*kernel).n * (*kernel).n;
+	if (taps <= KERNEL_DIRECT_TAPS)
+		ok = apply_run(&job.rows, kernel_band);
+	else
+		ok = kernel_fft_init(&job) && apply_run(&job.rows, kernel_tiles);
+
+	free(job.twiddles); free(job.spectrum);
+	return ok;
+}
+
+static inline int conv3_step(char param)
+{
+	return param != 'b' && param != 'g' && param != 'K';
+}
+
+int apply_steps(struct image_data *image, const struct apply_step *steps,
+				int count)
+{
+	// run the APPLY filters in order: consecutive 3x3 filters as one
+	// chain, 'b' - BOX_BLUR, 'g' - GAUSSIAN and 'K' - KERNEL on their own
+	// (0 - a filter could not run on the whole selection)
+	char *params = (char *)malloc(count);
+	if (!params) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(params));
+		return 0;
+	}
+
+	int ok = 1;
+	for (int k = 0, run; ok && k < count; k += run) {
+		run = 1;
+		if (steps[k].param == 'b') {
+			ok = box_exec(&(*image), (int)steps[k].value);
+		} else if (steps[k].param == 'g') {
+			ok = gaussian_exec(&(*image), steps[k].value);
+		} else if (steps[k].param == 'K') {
+			ok = kernel_exec(&(*image), steps[k].kernel);
 		} else {
-			printf("Invalid command\n");
-			free(coords);
-			return;
+			params[0] = steps[k].param;
+			while (k + run < count && conv3_step(steps[k + run].param)) {
+				params[run] = steps[k + run].param;
+				run++;
+			}
+			ok = apply_exec(&(*image), params, run);
 		}
-	if (token) {
-		printf("Invalid command\n");
-		free(coords);
+	}
+	free(params);
+	return ok;
+}
+
+struct point_op {
+	char type;    // 'I' - INVERT, 'G' - GAMMA, 'L' - LEVELS, 'T' - THRESHOLD
+	double gamma; // GAMMA <g>
+	int lo, hi;   // LEVELS <lo> <hi>, THRESHOLD <lo>
+};
+
+int point_value(struct point_op *op, int v, int limit)
+{
+	// new value of a sample after the point operation
+	double x = v;
+	switch ((*op).type) {
+	case 'I':
+		x = limit - v;
+		break;
+	case 'G':
+		x = limit ? limit * pow((double)v / limit, 1.0 / (*op).gamma) : 0;
+		break;
+	case 'L':
+		x = (double)(v - (*op).lo) * limit / ((*op).hi - (*op).lo);
+		break;
+	case 'T':
+		x = v >= (*op).lo ? limit : 0;
+		break;
+	}
+
+	x = clamp(x, 0, limit);
+	return (int)round(x);
+}
+
+int *point_lut(struct image_data *image)
+{
+	// table of the pending point operations of the image: value v of a
+	// sample will become lut[v]; created as the identity if missing
+	if (!(*image).lut) {
+		int levels = sample_levels(&(*image));
+		(*image).lut = (int *)malloc(levels * sizeof(int));
+		if (!(*image).lut) {
+			fprintf(stderr, "Malloc for %s failed\n", var_name(lut));
+			return NULL;
+		}
+		for (int v = 0; v < levels; v++)
+			(*image).lut[v] = v;
+	}
+	return (*image).lut;
+}
+
+#define DEFINE_LUT_KERNEL(sfx, type) \
+static void apply_lut_##sfx(void *row, size_t n, const int *lut) \
+{ \
+	/* replace each of the n samples with its value in lut */ \
+	type *s = (type *)row; \
+	size_t j = 0; \
+	for (; j + 4 <= n; j += 4) { \
+		type a = (type)lut[s[j]], b = (type)lut[s[j + 1]]; \
+		type c = (type)lut[s[j + 2]], d = (type)lut[s[j + 3]]; \
+		s[j] = a; s[j + 1] = b; s[j + 2] = c; s[j + 3] = d; \
+	} \
+	for (; j < n; j++) \
+		s[j] = (type)lut[s[j]]; \
+}
+SAMPLE_TYPES(DEFINE_LUT_KERNEL)
+
+void flush_point_ops(struct image_data *image)
+{
+	// point operations (EQUALIZE, INVERT, GAMMA, ...) are only composed
+	// in the table of the image; the table is applied to the pixels, in a
+	// single pass, by the first command that needs their values
+	if (!(*image).lut)
 		return;
+
+	size_t row_size = (size_t)(*image).width * (*image).channels;
+	for (int i = 0; i < (*image).height; i++)
+		SAMPLE_CALL(image, apply_lut, pixel_row(&(*image), i), row_size,
+					(*image).lut);
+
+	free((*image).lut);
+	(*image).lut = NULL;
+}
+
+// LOAD <file> stream: the image is read from the file, a strip of rows at
+// a time, by each command that needs its pixels (SAVE, HISTOGRAM,
+// EQUALIZE); the commands recorded meanwhile (CROP, point operations,
+// APPLY) run on each strip. A strip is read with the rows around it that
+// the filters reach (their halo, computed again for the next strip), so
+// the memory used is O(width x (strip + halo))
+#define STREAM_STRIP_BYTES (4 << 20)
+#define STREAM_STRIP_MIN 16 // fewest rows of a strip
+
+struct stream_stage *stream_stage_add(struct image_data *image, char op)
+{
+	// append a stage to the recorded ones of the streamed image
+	struct stream_source *stream = (*image).stream;
+	struct stream_stage *stages;
+	stages = (struct stream_stage *)realloc((*stream).stages,
+		((*stream).stage_count + 1) * sizeof(struct stream_stage));
+	if (!stages) {
+		fprintf(stderr, "Realloc for %s failed\n", var_name(stages));
+		return NULL;
 	}
+	(*stream).stages = stages;
 
-	order_coords(&coords);
+	struct stream_stage *stage = &stages[(*stream).stage_count++];
+	memset(stage, 0, sizeof(*stage));
+	(*stage).op = op;
+	return stage;
+}
 
-	// check if the interval is valid and update image_data struct
-	if (valid_coords(&coords, &(*image))) {
-		(*image).x1 = coords[0]; (*image).y1 = coords[1];
-		(*image).x2 = coords[2]; (*image).y2 = coords[3];
+struct stream_stage *stream_last(struct image_data *image, char op)
+{
+	// the last stage, if it has the given type (else NULL)
+	struct stream_source *stream = (*image).stream;
+	if (!(*stream).stage_count ||
+		(*stream).stages[(*stream).stage_count - 1].op != op)
+		return NULL;
+	return &(*stream).stages[(*stream).stage_count - 1];
+}
 
-		printf("Selected %d %d %d %d\n", coords[0], coords[1],
-			   coords[2], coords[3]);
-		free(coords);
+int *stream_lut(struct image_data *image)
+{
+	// table of the point operations after the recorded stages (the
+	// last one, if it is a table too, else a new identity table)
+	struct stream_stage *stage = stream_last(&(*image), 'L');
+	if (stage)
+		return (*stage).lut;
+
+	int levels = sample_levels(&(*image));
+	int *lut = (int *)malloc(levels * sizeof(int));
+	if (!lut) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(lut));
+		return NULL;
+	}
+	for (int v = 0; v < levels; v++)
+		lut[v] = v;
+
+	stage = stream_stage_add(&(*image), 'L');
+	if (!stage) {
+		free(lut);
+		return NULL;
+	}
+	(*stage).lut = lut;
+	return lut;
+}
+
+int stream_margin(const struct stream_stage *stage)
+{
+	// rows, above and below a strip, that its filters read; a filter
+	// also leaves the first and last rows of a selection unchanged
+	// (as the margins of the image), so each one needs at least one
+	int margin = 0;
+	for (int k = 0; k < (*stage).count; k++) {
+		const struct apply_step *step = &(*stage).steps[k];
+		if ((*step).param == 'b') {
+			margin += (int)(*step).value;
+		} else if ((*step).param == 'g') {
+			int widths[3];
+			gaussian_widths((*step).value, widths);
+			for (int pass = 0; pass < 3; pass++)
+				margin += widths[pass] > 1 ? widths[pass] / 2 : 0;
+		} else if ((*step).param == 'K') {
+			margin += (*(*step).kernel).n / 2 > 1 ?
+					  (*(*step).kernel).n / 2 : 1;
+		} else {
+			margin++;
+		}
+	}
+	return margin;
+}
+
+struct stream_reader {
+	struct text_reader text; // P2/P3
+	int *line;               // a row of numbers (text files)
+	int next;                // next row of the file
+};
 
+int stream_read_row(struct image_data *image, struct stream_reader *reader,
+					void *row)
+{
+	// read the next row of the streamed file (or store) in row
+	// (0 - a tile of the store could not be mapped)
+	struct stream_source *stream = (*image).stream;
+	size_t samples = (size_t)(*stream).width * (*image).channels;
+	if ((*stream).tiles) {
+		if (!tile_read_row((*stream).tiles, (*stream).view, (*reader).next,
+						   (*stream).width, (unsigned char *)row)) {
+			fprintf(stderr, "Mmap for %s failed\n", var_name(tile));
+			return 0;
+		}
+	} else if ((*image).type[1] == '2' || (*image).type[1] == '3') {
+		// missing elements are black, as in LOAD
+		int found = reader_numbers(&(*reader).text, (*reader).line, samples);
+		int max_color = (*image).max_color;
+		for (size_t j = 0; j < samples; j++)
+			(*reader).line[j] = j < (size_t)found ?
+								text_sample((*reader).line[j], max_color) : 0;
+		SAMPLE_CALL(image, store_row, (*reader).line, row, samples);
 	} else {
-		printf("Invalid set of coordinates\n");
-		free(coords);
+		size_t size = samples * (*image).depth;
+		size_t read = fread(row, 1, size, (*(*image).stream).file);
+		if (read < size)
+			memset((unsigned char *)row + read, 0, size - read);
+		if ((*image).depth == 2)
+			msb_row(row, samples);
 	}
+	(*reader).next++;
+	return 1;
 }
 
-void select_all(struct image_data *image)
+int stream_apply(struct image_data *strip, const struct stream_stage *stage,
+				 int offset)
 {
-	// SELECT ALL command
+	// run the filters of a stage on a strip, whose first row is the row
+	// offset of the image: each selection is cut to the rows of the strip
+	// (0 - a filter could not run)
+	for (int k = 0, count; k < (*stage).count; k += count) {
+		const struct apply_step *filter = &(*stage).steps[k];
+		for (count = 1; k + count < (*stage).count; count++) {
+			const struct apply_step *next = filter + count;
+			if ((*next).x1 != (*filter).x1 || (*next).y1 != (*filter).y1 ||
+				(*next).x2 != (*filter).x2 || (*next).y2 != (*filter).y2)
+				break;
+		}
 
-	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+		int y1 = clamp_int((*filter).y1 - offset, 0, (*strip).height);
+		int y2 = clamp_int((*filter).y2 - offset, 0, (*strip).height);
+		if (y1 >= y2)
+			continue;
+		(*strip).x1 = (*filter).x1; (*strip).x2 = (*filter).x2;
+		(*strip).y1 = y1; (*strip).y2 = y2;
+		if (!apply_steps(&(*strip), filter, count))
+			return 0;
+	}
+	return 1;
+}
+
+int stream_run(struct image_data *image,
+			   void (*sink)(struct image_data *, void *), void *arg)
+{
+	// one pass over the streamed file: each strip of the image, after
+	// the recorded stages, is given to sink (in order, top to bottom);
+	// if a row can't be read or a stage can't run, the pass stops
+	// before giving the strip to sink (0)
+	struct stream_source *stream = (*image).stream;
+	int n = (*stream).stage_count;
+	const struct stream_stage *stages = (*stream).stages;
+
+	// heights[s] - height of the image before the stage s
+	int *heights = (int *)malloc((n + 1) * sizeof(int));
+	int *margins = (int *)malloc((n + 1) * sizeof(int));
+	if (!heights || !margins) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(heights));
+		free(heights); free(margins);
+		return 0;
+	}
+	int halo = 0;
+	heights[0] = (*stream).height;
+	for (int s = 0; s < n; s++) {
+		margins[s] = stages[s].op == 'A' ? stream_margin(&stages[s]) : 0;
+		halo += margins[s];
+		heights[s + 1] = heights[s];
+		if (stages[s].op == 'C')
+			heights[s + 1] = stages[s].y2 - stages[s].y1;
+	}
+
+	size_t out_size = row_bytes(&(*image), (*image).width);
+	int strip = out_size ? (int)(STREAM_STRIP_BYTES / out_size) : 0;
+	if (strip < STREAM_STRIP_MIN)
+		strip = STREAM_STRIP_MIN;
+	int capacity = strip + 2 * halo;
+	if (capacity > (*stream).height)
+		capacity = (*stream).height;
+
+	// window - rows [lo, hi) of the file, work - the strip being processed
+	int width = (*stream).width, c = (*image).channels;
+	size_t size = row_bytes(&(*image), width);
+	struct stream_reader reader = {0};
+	void *window = NULL, *work = NULL;
+	int text = !(*stream).tiles &&
+			   ((*image).type[1] == '2' || (*image).type[1] == '3');
+	int ok = aloc_pixels(&window, (*image).depth, c, capacity, width) &&
+			 aloc_pixels(&work, (*image).depth, c, capacity, width);
+	if (ok && text) {
+		reader.line = (int *)malloc(((size_t)width * c + 1) * sizeof(int));
+		ok = reader.line && reader_init(&reader.text, (*stream).file,
+										READER_CHUNK);
+	}
+	if (!ok || (!(*stream).tiles &&
+				fseek((*stream).file, (*stream).offset, SEEK_SET))) {
+		free(window); free(work);
+		free(reader.line); reader_free(&reader.text);
+		free(heights); free(margins);
+		return 0;
+	}
+
+	int lo = 0, hi = 0;
+	for (int y0 = 0; y0 < heights[n]; y0 += strip) {
+		int y1 = y0 + strip < heights[n] ? y0 + strip : heights[n];
+
+		// rows of the file the strip [y0, y1) depends on
+		int from = y0, to = y1;
+		for (int s = n - 1; s >= 0; s--) {
+			if (stages[s].op == 'C') {
+				from += stages[s].y1; to += stages[s].y1;
+			}
+			from = from - margins[s] > 0 ? from - margins[s] : 0;
+			to = to + margins[s] < heights[s] ? to + margins[s] : heights[s];
+		}
+
+		// keep the rows still needed, skip the ones never needed
+		if (from < hi) {
+			memmove(window, (unsigned char *)window + (from - lo) * size,
+					(hi - from) * size);
+		} else {
+			for (; ok && reader.next < from; )
+				ok = stream_read_row(&(*image), &reader, window);
+			hi = from;
+		}
+		lo = from;
+		for (; ok && hi < to; hi++)
+			ok = stream_read_row(&(*image), &reader,
+								 (unsigned char *)window + (hi - lo) * size);
+		if (!ok)
+			break;
+
+		// the strip: a copy of the window, run through the stages
+		memcpy(work, window, (to - from) * size);
+		struct image_data part = {0};
+		memcpy(part.type, (*image).type, sizeof(part.type));
+		part.max_color = (*image).max_color;
+		part.channels = c; part.depth = (*image).depth;
+		part.stride = (size_t)width * c;
+		part.area = work;
+		part.width = width; part.height = to - from;
+
+		int offset = from; // row of the image the strip begins with
+		for (int s = 0; ok && s < n; s++) {
+			if (stages[s].op == 'L') {
+				for (int i = 0; i < part.height; i++)
+					SAMPLE_CALL(image, apply_lut, pixel_row(&part, i),
+								(size_t)part.width * c, stages[s].lut);
+			} else if (stages[s].op == 'C') {
+				int top = stages[s].y1 - offset > 0 ? stages[s].y1 - offset : 0;
+				part.area = pixel_at(&part, top, stages[s].x1);
+				part.width = stages[s].x2 - stages[s].x1;
+				offset += top - stages[s].y1;
+				part.height -= top;
+				if (part.height > heights[s + 1] - offset)
+					part.height = heights[s + 1] - offset;
+			} else {
+				ok = stream_apply(&part, &stages[s], offset);
+			}
+		}
+		if (!ok)
+			break;
+
+		part.area = pixel_row(&part, y0 - offset);
+		part.height = y1 - y0;
+		part.x1 = 0; part.y1 = 0;
+		part.x2 = part.width; part.y2 = part.height;
+		sink(&part, arg);
+	}
+
+	free(window); free(work);
+	if (text) {
+		free(reader.line); reader_free(&reader.text);
+	}
+	free(heights); free(margins);
+	return ok;
+}
+
+struct stream_copy {
+	void *pixels; // the whole image, rows back to back
+	int rows;     // rows copied so far
+};
+
+void stream_copy_sink(struct image_data *strip, void *arg)
+{
+	struct stream_copy *copy = (struct stream_copy *)arg;
+	size_t size = row_bytes(&(*strip), (*strip).width);
+	for (int i = 0; i < (*strip).height; i++)
+		memcpy((unsigned char *)(*copy).pixels +
+			   (size_t)(*copy).rows++ * size, pixel_row(&(*strip), i), size);
+}
+
+int stream_load(struct image_data *image)
+{
+	// the commands that move pixels across the whole image (ROTATE,
+	// FLIP) need it in memory: the streamed image is read entirely
+	struct stream_copy copy = {NULL, 0};
+	if (!aloc_pixels(&copy.pixels, (*image).depth, (*image).channels,
+					 (*image).height, (*image).width))
+		return 0;
+
+	if (!stream_run(&(*image), stream_copy_sink, &copy)) {
+		free(copy.pixels);
+		return 0;
+	}
+
+	stream_free((*image).stream);
+	(*image).stream = NULL;
+	set_pixels(&(*image), copy.pixels, (*image).height, (*image).width);
+	return 1;
+}
+
+void stream_count_sink(struct image_data *strip, void *arg)
+{
+	// add the samples of the strip to the frequencies (long long *),
+	// counted per strip first
+	long long *fr = (long long *)arg;
+	int levels = sample_levels(&(*strip));
+	int *counts = (int *)calloc(levels, sizeof(int));
+	if (!counts) {
+		fprintf(stderr, "Calloc for %s failed\n", var_name(counts));
 		return;
 	}
+	for (int i = 0; i < (*strip).height; i++)
+		SAMPLE_CALL(strip, count_row, pixel_row(&(*strip), i), counts,
+					(size_t)(*strip).width * (*strip).channels);
+	for (int v = 0; v < levels; v++)
+		fr[v] += counts[v];
+	free(counts);
+}
 
-	// update coords
+// rotations (ROTATE, and the pending ones of PIPELINE ON) work on square
+// tiles of pixels, so that both the rows read and the rows written stay
+// in the cache while a tile is moved
+#define ROTATE_TILE 32
+
+#define DEFINE_REMAP_KERNEL(sfx, type) \
+static void remap_tiled_##sfx(const type *origin, ptrdiff_t row_step, \
+							  ptrdiff_t col_step, type *dst, \
+							  size_t dst_stride, int width, int height, \
+							  int c, const int *lut) \
+{ \
+	/* pixel (i, j) of dst is origin[i * row_step + j * col_step], */ \
+	/* mapped through lut (if any) */ \
+	for (int ti = 0; ti < height; ti += ROTATE_TILE) \
+		for (int tj = 0; tj < width; tj += ROTATE_TILE) { \
+			int i_max = ti + ROTATE_TILE < height ? ti + ROTATE_TILE : height; \
+			int j_max = tj + ROTATE_TILE < width ? tj + ROTATE_TILE : width; \
+			for (int i = ti; i < i_max; i++) { \
+				type *row = dst + i * dst_stride; \
+				for (int j = tj; j < j_max; j++) { \
+					const type *pix = origin + i * row_step + j * col_step; \
+					for (int k = 0; k < c; k++) \
+						row[(size_t)j * c + k] = lut ? lut[pix[k]] : pix[k]; \
+				} \
+			} \
+		} \
+}
+SAMPLE_TYPES(DEFINE_REMAP_KERNEL)
+
+void materialize(struct image_data *image)
+{
+	// bring the pixels up to date with the commands recorded in
+	// PIPELINE ON mode and the pending point operations: rotations,
+	// flips and crops take one pass over the pixels, with the point
+	// operations fused in, then the filters run in their order
+	if ((*image).remapped) {
+		int (*m)[3] = (*image).view;
+		void *origin = pixel_at(&(*image), m[0][0], m[1][0]);
+
+		if (m[0][1] == 1 && m[0][2] == 0 && m[1][1] == 0 && m[1][2] == 1) {
+			// crops only: the image is a view of the same buffer
+			(*image).area = origin;
+			release_view_slack(&(*image));
+		} else {
+			int c = (*image).channels;
+			ptrdiff_t stride = (ptrdiff_t)(*image).stride;
+			void *remapped;
+			if (!aloc_pixels(&remapped, (*image).depth, c, (*image).height,
+							 (*image).width))
+				return;
+
+			SAMPLE_CALL(image, remap_tiled, origin,
+						m[0][1] * stride + m[1][1] * c,
+						m[0][2] * stride + m[1][2] * c, remapped,
+						(size_t)(*image).width * c, (*image).width,
+						(*image).height, c, (*image).lut);
+			free((*image).lut);
+			(*image).lut = NULL;
+			set_pixels(&(*image), remapped, (*image).height,
+					   (*image).width);
+		}
+		(*image).remapped = 0;
+	}
+	flush_point_ops(&(*image));
+
+	// each filter runs on the selection it was recorded with
+	if (!(*image).apply_count)
+		return;
+
+	// (consecutive filters on the same selection run as one chain)
+	int x1 = (*image).x1, y1 = (*image).y1;
+	int x2 = (*image).x2, y2 = (*image).y2;
+	for (int k = 0, count; k < (*image).apply_count; k += count) {
+		struct apply_step *filter = &(*image).applies[k];
+		for (count = 1; k + count < (*image).apply_count; count++) {
+			struct apply_step *next = filter + count;
+			if ((*next).x1 != (*filter).x1 || (*next).y1 != (*filter).y1 ||
+				(*next).x2 != (*filter).x2 || (*next).y2 != (*filter).y2)
+				break;
+		}
+
+		(*image).x1 = (*filter).x1; (*image).y1 = (*filter).y1;
+		(*image).x2 = (*filter).x2; (*image).y2 = (*filter).y2;
+		apply_steps(&(*image), filter, count);
+	}
+	(*image).x1 = x1; (*image).y1 = y1;
+	(*image).x2 = x2; (*image).y2 = y2;
+
+	for (int k = 0; k < (*image).apply_count; k++)
+		free((*image).applies[k].kernel);
+	free((*image).applies);
+	(*image).applies = NULL;
+	(*image).apply_count = 0;
+}
+
+void geometry_map(struct image_data *image, char op, int g[2][3])
+{
+	// a rotation or flip of the whole image or a crop to the selection:
+	// 'R' - 90 degrees, 'L' - -90 degrees, 'U' - 180 degrees,
+	// 'H' / 'V' - FLIP H / FLIP V, 'C' - CROP
+	// as the map g from the pixels (i', j') of the new image to the
+	// pixels (g[0] . (1, i', j'), g[1] . (1, i', j')) of the old one;
+	// the dimensions of the image become the new ones
+	int w = (*image).width, h = (*image).height;
+	int identity[2][3] = {{0, 1, 0}, {0, 0, 1}};
+	memcpy(g, identity, sizeof(identity));
+
+	switch (op) {
+	case 'R': {
+		int r[2][3] = {{h - 1, 0, -1}, {0, 1, 0}};
+		memcpy(g, r, sizeof(r)); (*image).width = h; (*image).height = w;
+		break;
+	}
+	case 'L': {
+		int r[2][3] = {{0, 0, 1}, {w - 1, -1, 0}};
+		memcpy(g, r, sizeof(r)); (*image).width = h; (*image).height = w;
+		break;
+	}
+	case 'U': {
+		int r[2][3] = {{h - 1, -1, 0}, {w - 1, 0, -1}};
+		memcpy(g, r, sizeof(r));
+		break;
+	}
+	case 'H': {
+		g[1][0] = w - 1; g[1][2] = -1;
+		break;
+	}
+	case 'V': {
+		g[0][0] = h - 1; g[0][1] = -1;
+		break;
+	}
+	case 'C': {
+		g[0][0] = (*image).y1; g[1][0] = (*image).x1;
+		(*image).width = (*image).x2 - (*image).x1;
+		(*image).height = (*image).y2 - (*image).y1;
+		break;
+	}
+	}
+
+	// the whole image stays selected
 	(*image).x1 = 0; (*image).y1 = 0;
 	(*image).x2 = (*image).width; (*image).y2 = (*image).height;
+}
+
+void compose_view(int m[2][3], int g[2][3])
+{
+	// compose a pending map with the next one: m = m o g
+	for (int r = 0; r < 2; r++) {
+		int m0 = m[r][0], m1 = m[r][1], m2 = m[r][2];
+		m[r][0] = m0 + m1 * g[0][0] + m2 * g[1][0];
+		m[r][1] = m1 * g[0][1] + m2 * g[1][1];
+		m[r][2] = m1 * g[0][2] + m2 * g[1][2];
+	}
+}
+
+void pipeline_geometry(struct image_data *image, char op)
+{
+	// record, in PIPELINE ON mode, a rotation or flip of the whole
+	// image or a crop to the selection (see geometry_map)
+
+	// filters recorded before run on the old image
+	if ((*image).apply_count)
+		materialize(&(*image));
+
+	if (!(*image).remapped) {
+		int identity[2][3] = {{0, 1, 0}, {0, 0, 1}};
+		memcpy((*image).view, identity, sizeof(identity));
+		(*image).remapped = 1;
+	}
+	int g[2][3];
+	geometry_map(&(*image), op, g);
+	compose_view((*image).view, g);
+}
+
+int stream_out_of_core(struct image_data *image)
+{
+	// a streamed image larger than the memory limit is not read in
+	// memory by the commands that need random access to its pixels
+	return (*image).stream &&
+		   row_bytes(&(*image), (*image).width) * (*image).height >
+		   memory_limit();
+}
+
+struct tile_copy {
+	struct tile_store *store;
+	int rows;    // rows stored so far
+	int failed;  // a tile could not be mapped
+};
+
+void stream_tile_sink(struct image_data *strip, void *arg)
+{
+	struct tile_copy *copy = (struct tile_copy *)arg;
+	for (int i = 0; i < (*strip).height && !(*copy).failed; i++)
+		(*copy).failed = !tile_write_row((*copy).store, (*copy).rows++,
+					(unsigned char *)pixel_row(&(*strip), i));
+}
+
+int stream_geometry(struct image_data *image, char op)
+{
+	// rotation or flip of a whole streamed image, out of memory: the
+	// image (after its stages) is written once in a tile store, then
+	// the rotations and flips only change the map it is read through
+	struct stream_source *stream = (*image).stream;
+	if ((*stream).tiles == NULL || (*stream).stage_count) {
+		struct tile_store *store = tile_store_open(&(*image));
+		struct stream_source *tiled;
+		tiled = (struct stream_source *)calloc(1, sizeof(*tiled));
+		struct tile_copy copy = {store, 0, 0};
+		if (!store || !tiled ||
+			!stream_run(&(*image), stream_tile_sink, &copy) || copy.failed) {
+			if (copy.failed)
+				fprintf(stderr, "Mmap for %s failed\n", var_name(tile));
+			tile_store_free(store); free(tiled);
+			return 0;
+		}
 
-	printf("Selected ALL\n");
+		int identity[2][3] = {{0, 1, 0}, {0, 0, 1}};
+		memcpy((*tiled).view, identity, sizeof(identity));
+		(*tiled).tiles = store;
+		stream_free(stream);
+		(*image).stream = stream = tiled;
+	}
+
+	int g[2][3];
+	geometry_map(&(*image), op, g);
+	compose_view((*stream).view, g);
+	(*stream).width = (*image).width; (*stream).height = (*image).height;
+	(*image).stride = (size_t)(*image).width * (*image).channels;
+	return 1;
 }
 
 int histogram_valid(char *token, char letter)
@@ -542,38 +3224,53 @@ int histogram_valid(char *token, char letter)
 	return 1;
 }
 
+int image_counts(struct image_data *image, long long *fr)
+{
+	// frequency of each sample value in the image (read in strips, if
+	// streamed); fr has sample_levels entries, all 0
+	if ((*image).stream)
+		return stream_run(&(*image), stream_count_sink, fr);
+
+	materialize(&(*image));
+	struct image_data whole = *image;
+	stream_count_sink(&whole, fr);
+	return 1;
+}
+
 void histogram_exec(struct image_data *image, int x, int y)
 {
-	// convention -- grayscale: (*image).area[0][i][j]
+	// convention -- grayscale: one sample per pixel
 
 	// calculate frequency of each pixel in the image
-	int *fr; fr = (int *)calloc(256, sizeof(int));
+	int levels = sample_limit(&(*image)) + 1;
+	long long *fr;
+	fr = (long long *)calloc(sample_levels(&(*image)), sizeof(long long));
 	if (!fr) {
 		fprintf(stderr, "Calloc for %s failed\n", var_name(fr));
 		return;
 	}
-	for (int i = 0; i < (*image).height; i++)
-		for (int j = 0; j < (*image).width; j++)
-			fr[(*image).area[0][i][j]]++;
+	if (!image_counts(&(*image), fr)) {
+		free(fr);
+		return;
+	}
 
-	int fr_max = -1;
+	long long fr_max = -1;
 
 	// calculate, in another vector, frequency for the number of intervals (y);
-	// thus we will have the frequency for (256 / y) groups of pixels
+	// thus we will have the frequency for (levels / y) groups of pixels
 
-	int *fr2; fr2 = (int *)calloc(256, sizeof(int));
+	long long *fr2; fr2 = (long long *)calloc(256, sizeof(long long));
 	if (!fr2) {
 		fprintf(stderr, "Calloc for %s failed\n", var_name(fr2));
 		free(fr);
 		return;
 	}
 
-	int line = 0;
-	for (int i = 0; i < 256; i++) {
-		fr2[line / (256 / y)] += fr[i];
-		if (fr_max < fr2[line / (256 / y)])
-			fr_max = fr2[line / (256 / y)];
-		line++;
+	for (int i = 0; i < levels; i++) {
+		int bin = (int)((long long)i * y / levels);
+		fr2[bin] += fr[i];
+		if (fr_max < fr2[bin])
+			fr_max = fr2[bin];
 	}
 
 	// output the Y rows, applying the formula and rounding down (floor)
@@ -583,10 +3280,10 @@ void histogram_exec(struct image_data *image, int x, int y)
 		num_stars = (int)floor(num_stars);
 
 		// output current y row
-		printf("%d\t|\t", (int)num_stars);
+		report("%d\t|\t", (int)num_stars);
 		for (int i = 0; i < (int)num_stars; i++)
-			printf("*");
-		printf("\n");
+			report("*");
+		report("\n");
 	}
 
 	free(fr); free(fr2);
@@ -597,43 +3294,43 @@ void histogram_image(char **command, struct image_data *image)
 	// HISTOGRAM <x> <y> command
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
 	char *parameter = *command + 9; // skip "HISTOGRAM"
 	if (parameter[0] != ' ') {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
 	// read parameters and check for validity
 	int x, y;
-	char *token; token = strtok(parameter + 1, " ");
+	char *token; token = command_token(parameter + 1, " ");
 	if (!token || !histogram_valid(token, 'x')) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 	x = atoi(token); // no. of stars
 
-	token = strtok(NULL, " ");
+	token = command_token(NULL, " ");
 	if (!token || !histogram_valid(token, 'y')) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 	y = atoi(token); // no. of bins
 
 	// another check if we have EXACTLY two parameters
-	token = strtok(NULL, " ");
+	token = command_token(NULL, " ");
 	if (token) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
 	// grayscale only
 	if ((*image).type[1] == '3' || (*image).type[1] == '6') {
-		printf("Black and white image needed\n");
+		report("Black and white image needed\n");
 		return;
 	}
 
@@ -646,207 +3343,304 @@ void equalize_image(struct image_data *image)
 	// EQUALIZE command
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
 	// grayscale only
 	if ((*image).type[1] == '3' || (*image).type[1] == '6') {
-		printf("Black and white image needed\n");
+		report("Black and white image needed\n");
 		return;
 	}
 
+	// the counts need the pixels with the recorded geometry and filters
+	// (the pending point operations are composed with the new table);
+	// a streamed image is read once for the counts, with its stages
+	if ((*image).remapped || (*image).apply_count)
+		materialize(&(*image));
+
 	// calculate frequency of each pixel in the image
-	int *fr; fr = (int *)calloc(256, sizeof(int));
+	int levels = sample_levels(&(*image));
+	int limit = sample_limit(&(*image));
+	long long *fr; fr = (long long *)calloc(levels, sizeof(long long));
 	if (!fr) {
 		fprintf(stderr, "Calloc for %s failed\n", var_name(*fr));
 		return;
 	}
 
-	for (int i = 0; i < (*image).height; i++)
-		for (int j = 0; j < (*image).width; j++)
-			fr[(*image).area[0][i][j]]++;
-
-	// using given formula, for each pixel we calculate a new value
-	int area_value = (*image).width * (*image).height;
-	int sum_h_i = 0;
-	double new_pixel = 0;
-
-	for (int i = 0; i < (*image).height; i++)
-		for (int j = 0; j < (*image).width; j++) {
-			int crt_pixel = (*image).area[0][i][j];
-			sum_h_i = 0;
+	if ((*image).stream) {
+		if (!stream_run(&(*image), stream_count_sink, fr)) {
+			free(fr);
+			return;
+		}
+	} else {
+		struct image_data whole = *image;
+		stream_count_sink(&whole, fr);
+	}
 
-			// calculate sum for current pixel
-			for (int k = 0; k <= crt_pixel; k++)
-				sum_h_i += fr[k];
+	// the pending point operations (if any) will move each value v to
+	// lut[v], so the frequencies are moved accordingly (those of a
+	// streamed image were counted after them)
+	int *lut = (*image).stream ? stream_lut(&(*image)) : point_lut(&(*image));
+	long long *sum_h = (long long *)calloc(levels, sizeof(long long));
+	if (!lut || !sum_h) {
+		fprintf(stderr, "Calloc for %s failed\n", var_name(sum_h));
+		free(fr); free(sum_h);
+		return;
+	}
+	for (int v = 0; v < levels; v++)
+		sum_h[(*image).stream ? v : lut[v]] += fr[v];
 
-			// calculate and assign new value for current pixel
-			new_pixel = (double)(255.0 * (1.0 / area_value) * sum_h_i);
-			new_pixel = clamp(new_pixel, 0, 255);
-			new_pixel = round(new_pixel);
+	// sum_h[v] - number of pixels with a value <= v (computed once)
+	for (int v = 1; v < levels; v++)
+		sum_h[v] += sum_h[v - 1];
 
-			(*image).area[0][i][j] = (int)new_pixel;
-		}
+	// using given formula, calculate the new value of each pixel value
+	// (reusing fr), then add it after the pending point operations
+	long long area_value = (long long)(*image).width * (*image).height;
+	double new_pixel = 0;
+	for (int v = 0; v < levels; v++) {
+		new_pixel = (double)(limit * (1.0 / area_value) * sum_h[v]);
+		new_pixel = clamp(new_pixel, 0, limit);
+		new_pixel = round(new_pixel);
+		fr[v] = (int)new_pixel;
+	}
+	for (int v = 0; v < levels; v++)
+		lut[v] = (int)fr[lut[v]];
 
-	free(fr);
-	printf("Equalize done\n");
+	free(sum_h); free(fr);
+	report("Equalize done\n");
 }
 
-int rotate_valid(char *token)
+int point_valid(char *token, double *value)
 {
-	// for ROTATE command, check if
-	// the token is a valid number (positive or negative)
-	for (size_t i = 0; i < strlen(token); i++)
-		if (!(('0' <= token[i] && token[i] <= '9') || token[i] == '-'))
-			return 0;
+	// check if the token is a valid (real) number
+	char *end;
+	*value = strtod(token, &end);
+	if (end == token || *end != '\0')
+		return 0;
 
 	return 1;
 }
 
-void rotate_exec(struct image_data *image, int ****copy,
-				 int ang_value, int type_matrix, int all_area)
+void point_image(char **command, struct image_data *image, char type)
 {
-	int width = (*image).x2 - (*image).x1;
-	int height = (*image).y2 - (*image).y1;
-
-	// depending on the angle value, assign new values for the
-	// pixels/channels of the image loaded; iterate through
-	// ***copy elements in a specific order, depending on the angle value
+	// INVERT / GAMMA <g> / LEVELS <lo> <hi> / THRESHOLD <t> commands
 
-	// all_area = 1 -> whole image
-	// all_area = 0 -> cropped area
+	// check for existing image
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
+		return;
+	}
 
-	switch (ang_value) {
-	case 90: case -270: {
-		for (int k = 0; k < type_matrix; k++) {
-			int pos_x1, pos_y1;
-			if (all_area == 0) {
-				pos_x1 = (*image).x1;
-				pos_y1 = (*image).y1;
-			} else {
-				pos_x1 = 0;
-				pos_y1 = 0;
-			}
+	struct point_op op = {0};
+	op.type = type;
+	// the operations map samples onto [0, max_color], whatever the depth
+	int limit = (*image).max_color;
+
+	// number of parameters and their position in the command
+	int params = 0;
+	char *parameter = *command;
+	switch (type) {
+	case 'G':
+		params = 1; parameter += 5; break; // skip "GAMMA"
+	case 'L':
+		params = 2; parameter += 6; break; // skip "LEVELS"
+	case 'T':
+		params = 1; parameter += 9; break; // skip "THRESHOLD"
+	}
 
-			for (int j = 0; j < width; j++) {
-				for (int i = height - 1; i >= 0; i--) {
-					(*image).area[k][pos_y1][pos_x1] = (*copy)[k][i][j];
-					pos_x1++;
-				}
-				if (all_area == 0)
-					pos_x1 = (*image).x1;
-				else
-					pos_x1 = 0;
+	// read parameters and check for validity
+	double value[2] = {0};
+	if (params) {
+		if (parameter[0] != ' ') {
+			report("Invalid command\n");
+			return;
+		}
 
-				pos_y1++;
+		char *token = command_token(parameter + 1, " ");
+		for (int i = 0; i < params; i++) {
+			if (!token || !point_valid(token, &value[i])) {
+				report("Invalid command\n");
+				return;
 			}
+			token = command_token(NULL, " ");
+		}
+		if (token) {
+			report("Invalid command\n");
+			return;
 		}
-		break;
 	}
 
-	case -90: case 270: {
-		for (int k = 0; k < type_matrix; k++) {
-			int pos_x1, pos_y1;
-			if (all_area == 0) {
-				pos_x1 = (*image).x1;
-				pos_y1 = (*image).y1;
-			} else {
-				pos_x1 = 0;
-				pos_y1 = 0;
-			}
+	op.gamma = value[0];
+	op.lo = (int)value[0]; op.hi = (int)value[1];
+	if ((type == 'G' && !(op.gamma > 0)) ||
+		(type == 'L' && (op.lo < 0 || op.lo >= op.hi || op.hi > limit)) ||
+		(type == 'T' && (op.lo < 0 || op.lo > limit))) {
+		report("Invalid set of parameters\n");
+		return;
+	}
 
-			for (int j = width - 1; j >= 0; j--) {
-				for (int i = 0; i < height; i++) {
-					(*image).area[k][pos_y1][pos_x1] = (*copy)[k][i][j];
-					pos_x1++;
-				}
-				if (all_area == 0)
-					pos_x1 = (*image).x1;
-				else
-					pos_x1 = 0;
+	// point operations run before the filters recorded in
+	// PIPELINE ON mode: those need to run first
+	if ((*image).apply_count)
+		materialize(&(*image));
 
-				pos_y1++;
-			}
-		}
-		break;
-	}
+	// add the operation to the pending ones: lut[v] = op(lut[v])
+	int *lut = (*image).stream ? stream_lut(&(*image)) : point_lut(&(*image));
+	if (!lut)
+		return;
+	for (int v = 0; v < sample_levels(&(*image)); v++)
+		lut[v] = point_value(&op, lut[v], limit);
+
+	switch (type) {
+	case 'I':
+		report("Invert done\n"); break;
+	case 'G':
+		report("Gamma done\n"); break;
+	case 'L':
+		report("Levels done\n"); break;
+	case 'T':
+		report("Threshold done\n"); break;
 	}
 }
 
-void rotate_select(struct image_data *image, int ang_value)
+int rotate_valid(char *token)
 {
-	// ROTATE case - select a portion of the image to rotate it
-
-	// currently loaded image type
-	int type_matrix;
-	if ((*image).type[1] == '2' || (*image).type[1] == '5')
-		type_matrix = 1; // grayscale
-	else
-		type_matrix = 3; // color
-
-	// depending of the image type, allocate memory and copy the
-	// selected area of the image matrix in the variable ***copy
-
-	int width = (*image).x2 - (*image).x1;
-	int height = (*image).y2 - (*image).y1;
-
-	int ***copy;
-	aloc_triple_ptr(&copy, type_matrix, height, width);
+	// for ROTATE command, check if
+	// the token is a valid number (positive or negative)
+	for (size_t i = 0; i < strlen(token); i++)
+		if (!(('0' <= token[i] && token[i] <= '9') || token[i] == '-'))
+			return 0;
 
-	for (int k = 0; k < type_matrix; k++)
-		for (int i = 0; i < height; i++)
-			for (int j = 0; j < width; j++) {
-				int sel_y = (*image).y1 + i;
-				int sel_x = (*image).x1 + j;
-				copy[k][i][j] = (*image).area[k][sel_y][sel_x];
-			}
+	return 1;
+}
 
-	// assign new values in the image matrix,
-	// using the copy of the selected area
-	rotate_exec(&(*image), &copy, ang_value, type_matrix, 0);
+#define DEFINE_ROTATE_KERNELS(sfx, type) \
+static void rotate_tiled_##sfx(const type *src, size_t src_stride, type *dst, \
+							   size_t dst_stride, int width, int height, \
+							   int c, int clockwise) \
+{ \
+	/* src is a height x width matrix of pixels, dst a width x height */ \
+	/* one; column j of src becomes row j (90) or row width - 1 - j */ \
+	/* (-90) of dst */ \
+	for (int ti = 0; ti < height; ti += ROTATE_TILE) \
+		for (int tj = 0; tj < width; tj += ROTATE_TILE) { \
+			int i_max = ti + ROTATE_TILE < height ? ti + ROTATE_TILE : height; \
+			int j_max = tj + ROTATE_TILE < width ? tj + ROTATE_TILE : width; \
+			for (int j = tj; j < j_max; j++) { \
+				int dst_i = clockwise ? j : width - 1 - j; \
+				type *row = dst + dst_i * dst_stride; \
+				for (int i = ti; i < i_max; i++) { \
+					int dst_j = clockwise ? height - 1 - i : i; \
+					const type *pix = src + i * src_stride + (size_t)j * c; \
+					for (int k = 0; k < c; k++) \
+						row[(size_t)dst_j * c + k] = pix[k]; \
+				} \
+			} \
+		} \
+} \
+static void rotate_square_##sfx(type *base, size_t stride, int n, int c, \
+								int clockwise) \
+{ \
+	/* in place, for an n x n matrix: each pixel of the top-left */ \
+	/* quadrant starts a cycle of four pixels, one on each side of */ \
+	/* its ring; the quadrant is walked by tiles, so the four tiles */ \
+	/* touched at a time stay in the cache */ \
+	int rows = n / 2, cols = (n + 1) / 2; \
+	for (int ti = 0; ti < rows; ti += ROTATE_TILE) \
+		for (int tj = 0; tj < cols; tj += ROTATE_TILE) { \
+			int i_max = ti + ROTATE_TILE < rows ? ti + ROTATE_TILE : rows; \
+			int j_max = tj + ROTATE_TILE < cols ? tj + ROTATE_TILE : cols; \
+			for (int i = ti; i < i_max; i++) \
+				for (int j = tj; j < j_max; j++) { \
+					type *a = base + i * stride + (size_t)j * c; \
+					type *b = base + j * stride + (size_t)(n - 1 - i) * c; \
+					type *d = base + (n - 1 - i) * stride + \
+							  (size_t)(n - 1 - j) * c; \
+					type *e = base + (n - 1 - j) * stride + (size_t)i * c; \
+					for (int k = 0; k < c; k++) { \
+						type aux = a[k]; \
+						if (clockwise) { \
+							a[k] = e[k]; e[k] = d[k]; \
+							d[k] = b[k]; b[k] = aux; \
+						} else { \
+							a[k] = b[k]; b[k] = d[k]; \
+							d[k] = e[k]; e[k] = aux; \
+						} \
+					} \
+				} \
+		} \
+}
+SAMPLE_TYPES(DEFINE_ROTATE_KERNELS)
+
+#define DEFINE_FLIP_KERNELS(sfx, type) \
+static void reverse_row_##sfx(type *a, type *b, int n, int c) \
+{ \
+	/* swap pixel l of row a with pixel n - 1 - l of row b; */ \
+	/* for a == b, the row is reversed */ \
+	int last = a == b ? n / 2 : n; \
+	for (int l = 0; l < last; l++) { \
+		type *p = a + (size_t)l * c, *q = b + (size_t)(n - 1 - l) * c; \
+		for (int k = 0; k < c; k++) { \
+			type aux = p[k]; \
+			p[k] = q[k]; q[k] = aux; \
+		} \
+	} \
+} \
+static void rotate_half_##sfx(type *base, size_t stride, int width, \
+							  int height, int c) \
+{ \
+	/* 180 degrees in one pass: row i and row height - 1 - i are */ \
+	/* swapped and reversed together */ \
+	for (int i = 0, r = height - 1; i <= r; i++, r--) \
+		reverse_row_##sfx(base + i * stride, base + r * stride, width, c); \
+} \
+static void flip_h_##sfx(type *base, size_t stride, int width, int height, \
+						 int c) \
+{ \
+	for (int i = 0; i < height; i++) \
+		reverse_row_##sfx(base + i * stride, base + i * stride, width, c); \
+}
+SAMPLE_TYPES(DEFINE_FLIP_KERNELS)
 
-	// free auxiliary matrix
-	for (int k = 0; k < type_matrix; k++) {
-		for (int i = 0; i < height; i++)
-			if (copy[k][i])
-				free(copy[k][i]);
-		if (copy[k])
-			free(copy[k]);
-	}
-	free(copy);
+void rotate_select(struct image_data *image, int ang_value)
+{
+	// ROTATE case - rotate a square selection of the image in place,
+	// with no copy of it (its pixels are cycled in groups of four)
+	int clockwise = ang_value == 90 || ang_value == -270;
+	SAMPLE_CALL(image, rotate_square, pixel_at(&(*image), (*image).y1,
+											   (*image).x1),
+				(*image).stride, (*image).x2 - (*image).x1,
+				(*image).channels, clockwise);
 }
 
 void rotate_all(struct image_data *image, int ang_value)
 {
 	// ROTATE case - select the whole image to rotate it
+	int c = (*image).channels;
+	int clockwise = ang_value == 90 || ang_value == -270;
 
-	// currently loaded image type
-	int type_matrix;
-	if ((*image).type[1] == '2' || (*image).type[1] == '5')
-		type_matrix = 1;
-	else
-		type_matrix = 3;
-
-	// depending on the image type, allocate memory and copy the
-	// whole image matrix in the variable ***copy
-	int ***copy;
-	aloc_triple_ptr(&copy, type_matrix, (*image).height, (*image).width);
+	// a square image keeps its dimensions: rotate it in place
+	if ((*image).width == (*image).height) {
+		SAMPLE_CALL(image, rotate_square, (*image).area, (*image).stride,
+					(*image).width, c, clockwise);
+		return;
+	}
 
-	for (int k = 0; k < type_matrix; k++)
-		for (int i = 0; i < (*image).height; i++)
-			for (int j = 0; j < (*image).width; j++)
-				copy[k][i][j] = (*image).area[k][i][j];
+	// else write the rotated pixels in a new buffer, with changed
+	// dimensions, which then replaces the old one
+	void *rotated;
+	if (!aloc_pixels(&rotated, (*image).depth, c, (*image).width,
+					 (*image).height))
+		return;
 
-	// memory reallocation for the image, with changed dimensions
-	// (-90/90 degrees rotation case)
-	free_image(&(*image), 0);
-	aloc_triple_ptr(&((*image).area), type_matrix,
-					(*image).width, (*image).height);
+	SAMPLE_CALL(image, rotate_tiled, (*image).area, (*image).stride,
+				rotated, (size_t)(*image).height * c, (*image).width,
+				(*image).height, c, clockwise);
 
-	// assign new values in the image matrix
-	rotate_exec(&(*image), &copy, ang_value, type_matrix, 1);
+	set_pixels(&(*image), rotated, (*image).width, (*image).height);
 
 	// after rotation, swap dimensions and coords
 	int aux;
@@ -858,16 +3652,15 @@ void rotate_all(struct image_data *image, int ang_value)
 	aux = (*image).x2;
 	(*image).x2 = (*image).y2;
 	(*image).y2 = aux;
+}
 
-	// free auxiliary matrix
-	for (int k = 0; k < type_matrix; k++) {
-		for (int i = 0; i < (*image).width; i++)
-			if (copy[k][i])
-				free(copy[k][i]);
-		if (copy[k])
-			free(copy[k]);
-	}
-	free(copy);
+void rotate_half(struct image_data *image)
+{
+	// ROTATE ±180 case - whole image or selection, in place
+	SAMPLE_CALL(image, rotate_half, pixel_at(&(*image), (*image).y1,
+											 (*image).x1),
+				(*image).stride, (*image).x2 - (*image).x1,
+				(*image).y2 - (*image).y1, (*image).channels);
 }
 
 void rotate_area(char **command, struct image_data *image)
@@ -875,115 +3668,115 @@ void rotate_area(char **command, struct image_data *image)
 	// ROTATE <angle> command
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
 	// check for valid angle
 	char *angle = *command + 6;
 	if (angle[0] != ' ') {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
-	char *token = strtok(angle + 1, " ");
+	char *token = command_token(angle + 1, " ");
 	if (!token || !rotate_valid(token)) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 	int ang_value = atoi(token);
 
 	// check if we have EXACTLY one parameter
-	token = strtok(NULL, " ");
+	token = command_token(NULL, " ");
 	if (token) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
 	// check if the angle is valid for rotation (±90, ±180, ±270, ±360)
 	if (ang_value < -360 || ang_value > 360 || ang_value % 90 != 0) {
-		printf("Unsupported rotation angle\n");
+		report("Unsupported rotation angle\n");
 		return;
 	}
 
 	// no rotation needed for 0/360 cases
 	if (ang_value == -360 || ang_value == 0 || ang_value == 360) {
-		printf("Rotated %d\n", ang_value);
+		report("Rotated %d\n", ang_value);
 		return;
 	}
 
-	// rotation cases: whole image (if...) or cropped area (else if...)
-	if (((*image).x1 == 0 && (*image).x2 == (*image).width) &&
-		((*image).y1 == 0 && (*image).y2 == (*image).height)) {
-		if (ang_value != 180 && ang_value != -180) {
-			rotate_all(&(*image), ang_value);
-		} else {
-			// for 180 degrees rotation, we rotate twice
-			// of course, this is not the most efficient way, but it is
-			// easier to implement
-			rotate_all(&(*image), 90);
-			rotate_all(&(*image), 90);
-		}
+	// rotation cases: whole image or square selection
+	int all_area = ((*image).x1 == 0 && (*image).x2 == (*image).width) &&
+				   ((*image).y1 == 0 && (*image).y2 == (*image).height);
+	if (!all_area &&
+		((*image).x2 - (*image).x1) != ((*image).y2 - (*image).y1)) {
+		report("The selection must be square\n");
+		return;
+	}
 
-	} else {
-		if (((*image).x2 - (*image).x1) == ((*image).y2 - (*image).y1)) {
-			if (ang_value != 180 && ang_value != -180) {
-				rotate_select(&(*image), ang_value);
-			} else {
-				rotate_select(&(*image), 90);
-				rotate_select(&(*image), 90);
-			}
+	int clockwise = ang_value == 90 || ang_value == -270;
+	char op = ang_value == 180 || ang_value == -180 ? 'U' :
+			  clockwise ? 'R' : 'L';
 
-		} else {
-			printf("The selection must be square\n");
-			return;
-		}
+	// rotations move pixels across the whole image: a streamed image is
+	// read in memory, or in a tile store if it doesn't fit
+	if (all_area && stream_out_of_core(&(*image))) {
+		if (stream_geometry(&(*image), op))
+			report("Rotated %d\n", ang_value);
+		return;
+	}
+	if ((*image).stream && !stream_load(&(*image)))
+		return;
+	if ((*image).pipeline && all_area) {
+		pipeline_geometry(&(*image), op);
+		report("Rotated %d\n", ang_value);
+		return;
 	}
 
-	printf("Rotated %d\n", ang_value);
+	materialize(&(*image));
+
+	if (ang_value == 180 || ang_value == -180)
+		rotate_half(&(*image));
+	else if (all_area)
+		rotate_all(&(*image), ang_value);
+	else
+		rotate_select(&(*image), ang_value);
+
+	report("Rotated %d\n", ang_value);
 }
 
-void crop_exec(struct image_data *image, int type_matrix)
+void crop_exec(struct image_data *image)
 {
-	// make a copy of the image matrix, with the selected area (if exists);
-	// else copy the whole image matrix
-	int ***copy;
+	// the image becomes a view of the selected area (if exists): only
+	// its first pixel and dimensions change, the rows stay where they
+	// are (with the same stride)
 	int new_width = (*image).x2 - (*image).x1;
 	int new_height = (*image).y2 - (*image).y1;
-
-	aloc_triple_ptr(&copy, type_matrix, new_height, new_width);
-
-	int crop_y = (*image).y1, crop_x = (*image).x1;
-	for (int i = 0; i < new_height; i++)
-		for (int j = 0; j < new_width; j++)
-			for (int k = 0; k < type_matrix; k++)
-				copy[k][i][j] = (*image).area[k][crop_y + i][crop_x + j];
-
-	// after assigning the new values in the copy, free initial image matrix
-	free_image(&(*image), 0);
-
-	aloc_triple_ptr(&((*image).area), type_matrix, new_height, new_width);
-
-	// assign the values from the copy of the selected area (or whole image)
-	// in the image matrix of the struct (*image)
-	for (int i = 0; i < new_height; i++)
-		for (int j = 0; j < new_width; j++)
-			for (int k = 0; k < type_matrix; k++)
-				(*image).area[k][i][j] = copy[k][i][j];
-
-	// free auxiliary matrix
-	for (int k = 0; k < type_matrix; k++) {
-		for (int i = 0; i < new_height; i++)
-			free(copy[k][i]);
-		free(copy[k]);
-	}
-	free(copy);
+	(*image).area = pixel_at(&(*image), (*image).y1, (*image).x1);
 
 	// update image dimensions and coords
 	(*image).x1 = 0; (*image).y1 = 0;
 	(*image).width = new_width; (*image).x2 = new_width;
 	(*image).height = new_height; (*image).y2 = new_height;
+
+	release_view_slack(&(*image));
+}
+
+void stream_crop(struct image_data *image)
+{
+	// CROP of a streamed image: recorded as a stage
+	struct stream_stage *stage = stream_stage_add(&(*image), 'C');
+	if (!stage)
+		return;
+	(*stage).x1 = (*image).x1; (*stage).y1 = (*image).y1;
+	(*stage).x2 = (*image).x2; (*stage).y2 = (*image).y2;
+
+	(*image).width = (*image).x2 - (*image).x1;
+	(*image).height = (*image).y2 - (*image).y1;
+	(*image).x1 = 0; (*image).y1 = 0;
+	(*image).x2 = (*image).width; (*image).y2 = (*image).height;
+	(*image).stride = (size_t)(*image).width * (*image).channels;
 }
 
 void crop_image(struct image_data *image)
@@ -991,156 +3784,170 @@ void crop_image(struct image_data *image)
 	// CROP command
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
-	// depending on the file type (P2/P5 or P3/P6),
-	// call the appropriate function
-	if ((*image).type[1] == '2' || ((*image).type[1] == '5'))
-		crop_exec(&(*image), 1);
-	else
-		crop_exec(&(*image), 3);
+	if ((*image).stream) {
+		stream_crop(&(*image));
+	} else if ((*image).pipeline) {
+		pipeline_geometry(&(*image), 'C');
+	} else {
+		materialize(&(*image));
+		crop_exec(&(*image));
+	}
 
-	printf("Image cropped\n");
+	report("Image cropped\n");
 }
 
-void apply_init(struct image_data *image, int *w, int *w_max,
-				int *h, int *h_max)
+void flip_v(struct image_data *image)
 {
-	// for APPLY command, initialize coords for the selected area
-	*w = (*image).x1; *w_max = (*image).x2;
-	*h = (*image).y1; *h_max = (*image).y2;
-
-	// margin pixels are not taken into account, only used for
-	// calculating values of their neighbors
-	if (*w == 0)
-		(*w)++;
-	if (*w_max == (*image).width)
-		(*w_max)--;
+	// swap the rows of the selection, top with bottom
+	size_t size = row_bytes(&(*image), (*image).x2 - (*image).x1);
+	void *aux = malloc(size);
+	if (!aux) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(aux));
+		return;
+	}
 
-	if (*h == 0)
-		(*h)++;
+	for (int i = (*image).y1, r = (*image).y2 - 1; i < r; i++, r--) {
+		void *top = pixel_at(&(*image), i, (*image).x1);
+		void *bottom = pixel_at(&(*image), r, (*image).x1);
+		memcpy(aux, top, size);
+		memcpy(top, bottom, size);
+		memcpy(bottom, aux, size);
+	}
 
-	if (*h_max == (*image).height)
-		(*h_max)--;
+	free(aux);
 }
 
-void apply_init_mat(double ***mat, char param)
+void flip_area(char **command, struct image_data *image)
 {
-	// Init 3x3 matrix to apply the parameter in the loaded image
-	switch (param) {
-	case 'E': {
-		(*mat)[0][0] = -1; (*mat)[0][1] = -1; (*mat)[0][2] = -1;
-		(*mat)[1][0] = -1; (*mat)[1][1] = 8; (*mat)[1][2] = -1;
-		(*mat)[2][0] = -1; (*mat)[2][1] = -1; (*mat)[2][2] = -1;
-		break;
-	}
+	// FLIP <H|V> command: mirror the selection horizontally
+	// (left-right) or vertically (top-bottom)
 
-	case 'S': {
-		(*mat)[0][0] = 0; (*mat)[0][1] = -1; (*mat)[0][2] = 0;
-		(*mat)[1][0] = -1; (*mat)[1][1] = 5; (*mat)[1][2] = -1;
-		(*mat)[2][0] = 0; (*mat)[2][1] = -1; (*mat)[2][2] = 0;
-		break;
+	// check for existing image
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
+		return;
 	}
 
-	case 'B': {
-		(*mat)[0][0] = 1; (*mat)[0][1] = 1; (*mat)[0][2] = 1;
-		(*mat)[1][0] = 1; (*mat)[1][1] = 1; (*mat)[1][2] = 1;
-		(*mat)[2][0] = 1; (*mat)[2][1] = 1; (*mat)[2][2] = 1;
-		break;
+	char *parameter = *command + 4; // skip "FLIP"
+	char *token = command_token(parameter, " ");
+	if (parameter[0] != ' ' || !token || command_token(NULL, " ") ||
+		(strcmp(token, "H") && strcmp(token, "V"))) {
+		report("Invalid command\n");
+		return;
 	}
 
-	case 'G': {
-		(*mat)[0][0] = 1; (*mat)[0][1] = 2; (*mat)[0][2] = 1;
-		(*mat)[1][0] = 2; (*mat)[1][1] = 4; (*mat)[1][2] = 2;
-		(*mat)[2][0] = 1; (*mat)[2][1] = 2; (*mat)[2][2] = 1;
-		break;
+	int all_area = (*image).x1 == 0 && (*image).y1 == 0 &&
+				   (*image).x2 == (*image).width &&
+				   (*image).y2 == (*image).height;
+	if (all_area && stream_out_of_core(&(*image))) {
+		if (stream_geometry(&(*image), token[0]))
+			report("Flipped %s\n", token);
+		return;
 	}
+	if ((*image).stream && !stream_load(&(*image)))
+		return;
+
+	if ((*image).pipeline && all_area) {
+		pipeline_geometry(&(*image), token[0]);
+		report("Flipped %s\n", token);
+		return;
 	}
+
+	materialize(&(*image));
+	if (token[0] == 'H')
+		SAMPLE_CALL(image, flip_h, pixel_at(&(*image), (*image).y1,
+											(*image).x1),
+					(*image).stride, (*image).x2 - (*image).x1,
+					(*image).y2 - (*image).y1, (*image).channels);
+	else
+		flip_v(&(*image));
+
+	report("Flipped %s\n", token);
 }
 
-void apply_exec(struct image_data *image, char param)
+int apply_filter(struct image_data *image, struct apply_step *steps,
+				 int count)
 {
-	// check which pixels will be modified (margins not taken)
-	int w, w_max, h, h_max;
-	apply_init(&(*image), &w, &w_max, &h, &h_max);
+	// run the filters on the selection, or record them (PIPELINE ON, or
+	// a streamed image); the kernels of the steps are freed once they ran
+	// (0 - the filters could not be run or recorded)
+	if (!(*image).pipeline && !(*image).stream) {
+		materialize(&(*image));
+		int ok = apply_steps(&(*image), steps, count);
+		for (int k = 0; k < count; k++)
+			free(steps[k].kernel);
+		return ok;
+	}
 
-	// allocate matrix for APPLY command
-	double **mat; mat = (double **)malloc(3 * sizeof(double *));
-	for (int i = 0; i < 3; i++)
-		mat[i] = (double *)malloc(3 * sizeof(double));
-
-	double sum = 0; // sum of current pixel (R/G/B)
-
-	// for each pixel, copy the values obtained temporarily in a vector *v
-	int total_size = (h_max - h + 1) * (w_max - w + 1) * 3;
-	int *v; v = (int *)malloc(total_size * sizeof(int));
-	if (!v) {
-		fprintf(stderr, "Malloc for %s failed\n", var_name(*v));
-		return;
-	}
-
-	int v_pos = 0;
-	for (int i = h; i < h_max; i++)
-		for (int j = w; j < w_max; j++)
-			for (int k = 0; k < 3; k++) {
-				// currently at (*image).area[k][h][w]
-				// for each channel of each pixel, calculate the sum
-				// corresponding to the parameter given in STDIN
-
-				// init corresponding matrix for the APPLY type
-				apply_init_mat(&mat, param);
-
-				mat[0][0] *= (double)((*image).area[k][i - 1][j - 1]);
-				mat[0][1] *= (double)((*image).area[k][i - 1][j]);
-				mat[0][2] *= (double)((*image).area[k][i - 1][j + 1]);
-				mat[1][0] *= (double)((*image).area[k][i][j - 1]);
-				mat[1][1] *= (double)((*image).area[k][i][j]);
-				mat[1][2] *= (double)((*image).area[k][i][j + 1]);
-				mat[2][0] *= (double)((*image).area[k][i + 1][j - 1]);
-				mat[2][1] *= (double)((*image).area[k][i + 1][j]);
-				mat[2][2] *= (double)((*image).area[k][i + 1][j + 1]);
-
-				// calculate sum
-				sum = 0;
-				for (int l = 0; l < 3; l++)
-					for (int c = 0; c < 3; c++)
-						sum += mat[l][c];
-
-				// using the formula, modify the sum where needed
-				if (param == 'B')
-					sum = (double)(sum / 9);
-				else if (param == 'G')
-					sum = (double)(sum / 16);
-
-				// apply clump(), round and add the result in auxiliary vector
-				sum = clamp(sum, 0, 255); sum = round(sum);
-				v[v_pos++] = (int)sum;
-			}
+	struct apply_step **list = &(*image).applies;
+	int *list_count = &(*image).apply_count;
+	if ((*image).stream) {
+		struct stream_stage *stage = stream_last(&(*image), 'A');
+		if (!stage)
+			stage = stream_stage_add(&(*image), 'A');
+		if (!stage) {
+			for (int k = 0; k < count; k++)
+				free(steps[k].kernel);
+			return 0;
+		}
+		list = &(*stage).steps;
+		list_count = &(*stage).count;
+	}
 
-	// next, copy the new values obtained
-	v_pos = 0;
-	for (int i = h; i < h_max; i++)
-		for (int j = w; j < w_max; j++)
-			for (int k = 0; k < 3; k++)
-				(*image).area[k][i][j] = v[v_pos++];
+	struct apply_step *applies;
+	applies = (struct apply_step *)realloc(*list,
+		(*list_count + count) * sizeof(struct apply_step));
+	if (!applies) {
+		fprintf(stderr, "Realloc for %s failed\n", var_name(applies));
+		for (int k = 0; k < count; k++)
+			free(steps[k].kernel);
+		return 0;
+	}
 
-	// free resources
-	free(v);
-	for (int i = 0; i < 3; i++)
-		free(mat[i]);
-	free(mat);
+	for (int k = 0; k < count; k++) {
+		steps[k].x1 = (*image).x1; steps[k].y1 = (*image).y1;
+		steps[k].x2 = (*image).x2; steps[k].y2 = (*image).y2;
+		applies[(*list_count)++] = steps[k];
+	}
+	*list = applies;
+	return 1;
+}
+
+// APPLY parameters, with the letters of their filters (the last three
+// are followed by a value: BOX_BLUR <r>, GAUSSIAN <sigma>, KERNEL <file>)
+#define APPLY_FILTERS 7
+const char *apply_names[] = {"EDGE", "SHARPEN", "BLUR", "GAUSSIAN_BLUR",
+							 "BOX_BLUR", "GAUSSIAN", "KERNEL"};
+const char apply_letters[] = "ESBGbgK";
+
+#define GAUSSIAN_SIGMA_MAX 2000.0
+
+int apply_value(char letter, char *token, double *value)
+{
+	// check the value of BOX_BLUR (integer radius) / GAUSSIAN (sigma)
+	if (!token || !point_valid(token, value))
+		return 0;
+
+	if (letter == 'b')
+		return *value == floor(*value) && *value >= 1 &&
+			   *value <= BOX_RADIUS_MAX;
+
+	return *value > 0 && *value <= GAUSSIAN_SIGMA_MAX;
 }
 
 void apply_area(char **command, struct image_data *image)
 {
-	// APPLY <PARAMETER> command
+	// APPLY <PARAMETER> [PARAMETER ...] command: the filters run in the
+	// given order, as one chain
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
@@ -1148,86 +3955,300 @@ void apply_area(char **command, struct image_data *image)
 
 	char *parameter = *command + 5; // skip "APPLY"
 	if (parameter[0] != ' ') {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
+	// at most one parameter every two characters
+	size_t size = strlen(parameter) / 2 + 1;
+
 	// check for parameter existence
-	char *token; token = strtok(parameter, " ");
+	char *token; token = command_token(parameter, " ");
 	if (!token) {
-		printf("Invalid command\n");
+		report("Invalid command\n");
 		return;
 	}
 
 	// color only
 	if ((*image).type[1] == '2' || (*image).type[1] == '5') {
-		printf("Easy, Charlie Chaplin\n");
+		report("Easy, Charlie Chaplin\n");
 		return;
 	}
 
-	// call the corresponding function
-	if (!strcmp(token, "EDGE")) {
-		apply_exec(&(*image), 'E');
-		printf("APPLY %s done\n", token);
+	// every parameter has to be valid; params[k] - index in apply_names
+	int *params = (int *)malloc(size * sizeof(int));
+	struct apply_step *steps;
+	steps = (struct apply_step *)calloc(size, sizeof(struct apply_step));
+	if (!params || !steps) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(params));
+		free(params); free(steps);
 		return;
 	}
 
-	if (!strcmp(token, "SHARPEN")) {
-		apply_exec(&(*image), 'S');
-		printf("APPLY %s done\n", token);
+	int count = 0, valid = 1;
+	for (; token && valid; token = command_token(NULL, " ")) {
+		int k = 0;
+		while (k < APPLY_FILTERS && strcmp(token, apply_names[k]))
+			k++;
+		params[count] = k;
+		steps[count].param = k < APPLY_FILTERS ? apply_letters[k] : 0;
+		if (k == APPLY_FILTERS) {
+			valid = 0;
+		} else if (steps[count].param == 'K') {
+			char *name = command_token(NULL, " ");
+			if (name)
+				steps[count].kernel = kernel_load(name);
+			if (name && !steps[count].kernel)
+				report("Failed to load %s\n", name);
+			valid = steps[count].kernel != NULL;
+		} else if (steps[count].param == 'b' || steps[count].param == 'g') {
+			valid = apply_value(steps[count].param, command_token(NULL, " "),
+								&steps[count].value);
+		}
+		count++;
+	}
+
+	if (!valid) {
+		report("APPLY parameter invalid\n");
+		for (int k = 0; k < count; k++)
+			free(steps[k].kernel);
+		free(params); free(steps);
 		return;
 	}
 
-	if (!strcmp(token, "BLUR")) {
-		apply_exec(&(*image), 'B');
-		printf("APPLY %s done\n", token);
+	// call the corresponding function
+	if (apply_filter(&(*image), steps, count))
+		for (int k = 0; k < count; k++)
+			report("APPLY %s done\n", apply_names[params[k]]);
+	else
+		report("APPLY failed\n");
+
+	free(params); free(steps);
+}
+
+void write_before_matrix(FILE **image_file, struct image_data *image, int *save)
+{
+	// write in the file the input data,
+	// stopping at the beginning of the matrix
+	fputc((*image).type[0], *image_file);
+
+	// depending on the file type and save location  (0 - binary, 1 - text),
+	// update *save variable
+	if ((*image).type[1] == '2' || ((*image).type[1] == '5')) {
+		// grayscale image
+
+		if (*save == 1) {
+			*save = 2;
+			fputc('2', *image_file);
+		} else {
+			*save = 5;
+			fputc('5', *image_file);
+		}
+
+	} else {
+		// color image
+
+		if (*save == 1) {
+			*save = 3;
+			fputc('3', *image_file);
+		} else {
+			*save = 6;
+			fputc('6', *image_file);
+		}
+	}
+	fputc('\n', *image_file);
+
+	// write next set of input data, without the matrix
+	fprintf(*image_file, "%d %d\n", (*image).width, (*image).height);
+	fprintf(*image_file, "%d\n", (*image).max_color);
+}
+
+// size of the blocks the matrix is written with (SAVE)
+#define WRITER_CHUNK (1 << 20)
+
+FILE *open_save_file(const char *name, const char *mode, char **tmp_name)
+{
+	// the file is written under a temporary name in the same directory,
+	// then renamed over the destination (see close_save_file), so that
+	// the destination is replaced in a single step; if the temporary
+	// file can't be created (e.g. no write access to the directory),
+	// nothing is saved rather than truncating the destination
+	*tmp_name = (char *)malloc(strlen(name) + 32);
+	if (!*tmp_name) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(tmp_name));
+		return NULL;
+	}
+	sprintf(*tmp_name, "%s.tmp%ld", name, (long)getpid());
+	FILE *file = fopen(*tmp_name, mode);
+	if (!file) {
+		free(*tmp_name);
+		*tmp_name = NULL;
+	}
+	return file;
+}
+
+int close_save_file(FILE **image_file, const char *name, char **tmp_name)
+{
+	// returns 1 if the destination was replaced with the written file;
+	// otherwise the temporary file is removed and the destination kept
+	int failed = ferror(*image_file);
+	failed |= fclose(*image_file);
+	*image_file = NULL;
+
+	if (failed || rename(*tmp_name, name)) {
+		remove(*tmp_name);
+		failed = 1;
+	}
+	free(*tmp_name);
+	*tmp_name = NULL;
+	return !failed;
+}
+
+void write_binary_matrix(FILE **image_file, struct image_data *image)
+{
+	// write the matrix of a binary file (P5/P6) with bulk writes
+	int n = (*image).height;
+	size_t size = row_bytes(&(*image), (*image).width);
+
+	if ((*image).depth == 1) {
+		// 8-bit samples already have the layout of the file: write the
+		// rows straight from the pixel buffer (one call if back to back)
+		if ((*image).stride == (size_t)(*image).width * (*image).channels) {
+			fwrite((*image).area, 1, size * n, *image_file);
+		} else {
+			for (int i = 0; i < n; i++)
+				fwrite(pixel_row(&(*image), i), 1, size, *image_file);
+		}
 		return;
 	}
 
-	if (!strcmp(token, "GAUSSIAN_BLUR")) {
-		apply_exec(&(*image), 'G');
-		printf("APPLY %s done\n", token);
+	// 16-bit samples are written MSB first, through a buffer
+	// filled with as many rows as fit in WRITER_CHUNK bytes
+	int lines = WRITER_CHUNK / size;
+	if (lines < 1)
+		lines = 1;
+	if (lines > n)
+		lines = n;
+
+	unsigned char *buffer = (unsigned char *)malloc(lines * size);
+	if (!buffer) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(buffer));
 		return;
 	}
 
-	printf("APPLY parameter invalid\n");
+	for (int i = 0; i < n; i += lines) {
+		unsigned char *out = buffer;
+		for (int l = i; l < n && l < i + lines; l++) {
+			const uint16_t *row = (const uint16_t *)pixel_row(&(*image), l);
+			for (size_t j = 0; j < size / 2; j++) {
+				*out++ = (unsigned char)(row[j] >> 8);
+				*out++ = (unsigned char)row[j];
+			}
+		}
+		fwrite(buffer, 1, out - buffer, *image_file);
+	}
+	free(buffer);
+}
+
+// text form of every sample value, with the separator written after it
+// ("%d "), padded to 8 bytes so that it can be copied in a single move
+struct sample_text {
+	char text[7];
+	unsigned char len;
+};
+
+struct sample_text *digit_table;
+
+int init_digit_table(void)
+{
+	// build the table for all values 0..65535 (done once)
+	if (digit_table)
+		return 1;
+
+	struct sample_text *table;
+	table = (struct sample_text *)malloc(65536 * sizeof(*table));
+	if (!table) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(table));
+		return 0;
+	}
+
+	for (int v = 0; v < 65536; v++) {
+		char digits[6];
+		int len = 0, x = v;
+		do {
+			digits[len++] = (char)('0' + x % 10);
+			x /= 10;
+		} while (x);
+
+		for (int i = 0; i < len; i++)
+			table[v].text[i] = digits[len - 1 - i];
+		table[v].text[len] = ' ';
+		table[v].len = (unsigned char)(len + 1);
+	}
+
+	digit_table = table;
+	return 1;
+}
+
+#define DEFINE_FORMAT_KERNEL(sfx, type) \
+static inline char *format_row_##sfx(const void *src, size_t n, char *out) \
+{ \
+	/* append the n samples as text; out needs 8 bytes of slack */ \
+	const type *s = (const type *)src; \
+	for (size_t j = 0; j < n; j++) { \
+		const struct sample_text *t = &digit_table[s[j]]; \
+		memcpy(out, t, sizeof(*t)); \
+		out += (*t).len; \
+	} \
+	return out; \
 }
+SAMPLE_TYPES(DEFINE_FORMAT_KERNEL)
 
-void write_before_matrix(FILE **image_file, struct image_data *image, int *save)
+void write_text_matrix(FILE **image_file, struct image_data *image)
 {
-	// write in the file the input data,
-	// stopping at the beginning of the matrix
-	fputc((*image).type[0], *image_file);
+	// write the matrix of a text file (P2/P3): samples are formatted
+	// through the digit table in a buffer, written in WRITER_CHUNK blocks
+	if (!init_digit_table())
+		return;
 
-	// depending on the file type and save location  (0 - binary, 1 - text),
-	// update *save variable
-	if ((*image).type[1] == '2' || ((*image).type[1] == '5')) {
-		// grayscale image
+	size_t row_size = (size_t)(*image).width * (*image).channels;
 
-		if (*save == 1) {
-			*save = 2;
-			fputc('2', *image_file);
-		} else {
-			*save = 5;
-			fputc('5', *image_file);
-		}
+	// room for a chunk, plus a whole row ("65535 " per sample and '\n')
+	size_t capacity = WRITER_CHUNK + row_size * 6 + 16;
+	char *buffer = (char *)malloc(capacity);
+	if (!buffer) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(buffer));
+		return;
+	}
 
-	} else {
-		// color image
+	char *out = buffer;
+	for (int i = 0; i < (*image).height; i++) {
+		out = SAMPLE_CALL(image, format_row, pixel_row(&(*image), i),
+						  row_size, out);
+		*out++ = '\n';
 
-		if (*save == 1) {
-			*save = 3;
-			fputc('3', *image_file);
-		} else {
-			*save = 6;
-			fputc('6', *image_file);
+		if (out - buffer >= WRITER_CHUNK) {
+			fwrite(buffer, 1, out - buffer, *image_file);
+			out = buffer;
 		}
 	}
-	fputc('\n', *image_file);
+	fwrite(buffer, 1, out - buffer, *image_file);
+	free(buffer);
+}
 
-	// write next set of input data, without the matrix
-	fprintf(*image_file, "%d %d\n", (*image).width, (*image).height);
-	fprintf(*image_file, "%d\n", (*image).max_color);
+struct stream_save {
+	FILE *file;
+	int save; // 2/3 - text, 5/6 - binary
+};
+
+void stream_save_sink(struct image_data *strip, void *arg)
+{
+	// SAVE of a streamed image: each strip is written once processed
+	struct stream_save *out = (struct stream_save *)arg;
+	if ((*out).save == 2 || (*out).save == 3)
+		write_text_matrix(&(*out).file, &(*strip));
+	else
+		write_binary_matrix(&(*out).file, &(*strip));
 }
 
 void save_file(char **command, struct image_data *image)
@@ -1235,8 +4256,8 @@ void save_file(char **command, struct image_data *image)
 	// SAVE <file> [ascii] command
 
 	// check for existing image
-	if (!(*image).area) {
-		printf("No image loaded\n");
+	if (!image_loaded(&(*image))) {
+		report("No image loaded\n");
 		return;
 	}
 
@@ -1244,70 +4265,137 @@ void save_file(char **command, struct image_data *image)
 	int i = 0, mem = 0;
 
 	// save filename in *image_name
-	char *image_name;
-	if (pos[i] != ' ' && pos[i] != '\0') {
-		image_name = (char *)calloc(128, sizeof(char));
-		if (!image_name) {
-			fprintf(stderr, "Calloc for %s failed\n", var_name(image_name));
-			return;
-		}
-		image_name[mem++] = pos[i++];
-		while (pos[i] != ' ' && pos[i] != '\0')
-			image_name[mem++] = pos[i++];
+	if (pos[i] == ' ' || pos[i] == '\0') {
+		report("Invalid command\n");
+		return;
+	}
+	char *image_name = (char *)calloc(strlen(pos) + 1, sizeof(char));
+	if (!image_name) {
+		fprintf(stderr, "Calloc for %s failed\n", var_name(image_name));
+		return;
 	}
+	image_name[mem++] = pos[i++];
+	while (pos[i] != ' ' && pos[i] != '\0')
+		image_name[mem++] = pos[i++];
 
 	// check if the optional 'ascii' was given
 
+	materialize(&(*image));
+
+	// the mapped file can't be truncated while the image still reads it
+	if (is_mapped_file(&(*image), image_name) && !compact_pixels(&(*image))) {
+		free(image_name);
+		return;
+	}
+
 	int save; // 0 - binary, 1 - text
 	FILE *image_file;
+	char *tmp_name;
 	if (!strcmp(pos, image_name)) {
-		image_file = fopen(image_name, "wb");
+		image_file = open_save_file(image_name, "wb", &tmp_name);
 		save = 0;
 	} else {
-		image_file = fopen(image_name, "wt");
+		image_file = open_save_file(image_name, "wt", &tmp_name);
 		save = 1;
 	}
+	if (!image_file) {
+		fprintf(stderr, "Fopen for %s failed\n", image_name);
+		report("Failed to save %s\n", image_name);
+		free(image_name);
+		return;
+	}
 
 	// depending on the file type (P2/P3/P5/P6), write the data
 	write_before_matrix(&image_file, &(*image), &save);
-	switch (save) {
-	case 2: {
-		// P2 - text file, grayscale image
-		for (int i = 0; i < (*image).height; i++) {
-			for (int j = 0; j < (*image).width; j++)
-				fprintf(image_file, "%d ", (*image).area[0][i][j]);
-			fprintf(image_file, "\n");
+	if ((*image).stream) {
+		struct stream_save out = {image_file, save};
+		if (!stream_run(&(*image), stream_save_sink, &out)) {
+			// keep the destination as it was
+			fclose(image_file);
+			remove(tmp_name);
+			report("Failed to save %s\n", image_name);
+			free(tmp_name); free(image_name);
+			return;
 		}
-		break;
+		save = 0;
 	}
-	case 3: {
-		// P3 - text file, color image
-		for (int i = 0; i < (*image).height; i++) {
-			for (int j = 0; j < (*image).width; j++)
-				for (int k = 0; k < 3; k++)
-					fprintf(image_file, "%d ", (*image).area[k][i][j]);
-			fprintf(image_file, "\n");
-		}
+	switch (save) {
+	case 2: case 3: {
+		// P2/P3 - text file, grayscale/color image
+		write_text_matrix(&image_file, &(*image));
 		break;
 	}
-	case 5: {
-		// P5 - grayscale image, binary file
-		for (int i = 0; i < (*image).height; i++)
-			for (int j = 0; j < (*image).width; j++)
-				fprintf(image_file, "%c", (char)(*image).area[0][i][j]);
+	case 5: case 6: {
+		// P5/P6 - grayscale/color image, binary file
+		write_binary_matrix(&image_file, &(*image));
 		break;
 	}
-	case 6: {
-		// P6 - color image, binary file
-		for (int i = 0; i < (*image).height; i++)
-			for (int j = 0; j < (*image).width; j++)
-				for (int k = 0; k < 3; k++)
-					fprintf(image_file, "%c", (char)(*image).area[k][i][j]);
-		break;
 	}
+	if (close_save_file(&image_file, image_name, &tmp_name))
+		report("Saved %s\n", image_name);
+	else
+		report("Failed to save %s\n", image_name);
+	free(image_name);
+}
+
+void pipeline_mode(char **command, struct image_data *image)
+{
+	// PIPELINE <ON|OFF> command: with ON, rotations, flips, crops and
+	// filters are only recorded, and run by the first command that
+	// needs the pixels (HISTOGRAM, EQUALIZE, SAVE, ...)
+	char *parameter = *command + 8; // skip "PIPELINE"
+	char *token = command_token(parameter, " ");
+	if (parameter[0] != ' ' || !token || command_token(NULL, " ") ||
+		(strcmp(token, "ON") && strcmp(token, "OFF"))) {
+		report("Invalid command\n");
+		return;
+	}
+
+	(*image).pipeline = !strcmp(token, "ON");
+	if (!(*image).pipeline)
+		materialize(&(*image));
+
+	report("Pipeline %s\n", token);
+}
+
+#define THREADS_MAX 256
+
+void set_threads(char **command)
+{
+	// THREADS <n> command: restart the pool with n threads
+
+	// the pool may only be rebuilt while nothing else can reach it: the
+	// workers of a batch all share it, so it is refused there, and the
+	// LOAD decoder of the I/O thread is held off by pool_rebuild
+	if (messages) {
+		report("Invalid command\n");
+		return;
+	}
+
+	char *parameter = *command + 7; // skip "THREADS"
+	char *token = command_token(parameter, " ");
+	if (parameter[0] != ' ' || !token || command_token(NULL, " ")) {
+		report("Invalid command\n");
+		return;
+	}
+
+	for (int i = 0; token[i]; i++)
+		if (!is_number(token[i])) {
+			report("Invalid set of parameters\n");
+			return;
+		}
+
+	int threads = atoi(token);
+	if (strlen(token) > 3 || threads < 1 || threads > THREADS_MAX) {
+		report("Invalid set of parameters\n");
+		return;
 	}
-	printf("Saved %s\n", image_name);
-	fclose(image_file); free(image_name);
+
+	pthread_mutex_lock(&pool_rebuild);
+	pool_destroy(&pool);
+	pool_init(&pool, threads);
+	pthread_mutex_unlock(&pool_rebuild);
+	report("Using %d threads\n", pool.size);
 }
 
 char command_selection(char *command, struct image_data image)
@@ -1345,17 +4433,45 @@ char command_selection(char *command, struct image_data image)
 	if (valid && !strcmp(command, valid))
 		command_letter = 'C';
 
+	valid = strstr(command, "FLIP");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'F';
+
 	valid = strstr(command, "APPLY");
 	if (valid && !strcmp(command, valid))
 		command_letter = 'A';
 
+	valid = strstr(command, "INVERT");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'I';
+
+	valid = strstr(command, "GAMMA");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'G';
+
+	valid = strstr(command, "LEVELS");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'V';
+
+	valid = strstr(command, "THRESHOLD");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'T';
+
+	valid = strstr(command, "THREADS");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'N';
+
+	valid = strstr(command, "PIPELINE");
+	if (valid && !strcmp(command, valid))
+		command_letter = 'P';
+
 	valid = strstr(command, "SAVE ");
 	if (valid && !strcmp(command, valid))
 		command_letter = '$';
 
 	valid = strstr(command, "EXIT");
 	if (valid && !strcmp(command, valid)) {
-		if (!(image.area))
+		if (!image_loaded(&image))
 			command_letter = '0';
 		else
 			command_letter = '1';
@@ -1364,74 +4480,583 @@ char command_selection(char *command, struct image_data image)
 	return command_letter;
 }
 
-int main(void)
+size_t parse_size(const char *text)
 {
-	// input commands will be stored in *command
-	char *command;
+	// --max-memory value: bytes, or with a K/M/G suffix (0 - invalid)
+	char *end;
+	double value = strtod(text, &end);
+	size_t unit = 1;
+	if (*end == 'K' || *end == 'k')
+		unit = (size_t)1 << 10;
+	else if (*end == 'M' || *end == 'm')
+		unit = (size_t)1 << 20;
+	else if (*end == 'G' || *end == 'g')
+		unit = (size_t)1 << 30;
+	if (end == text || (unit > 1 && end[1]) || (unit == 1 && *end) ||
+		!(value > 0))
+		return 0;
+	return (size_t)(value * unit);
+}
 
-	// init image struct
-	struct image_data image = {0};
+int run_command(char **command, struct image_data *image)
+{
+	// execute one command line; 0 - EXIT, with a loaded image
+	char cmd = command_selection(*command, *image);
 
-	// Execute commands until we reach the EXIT case,
-	// with a loaded image
-	int run = 1;
-	while (run) {
-		scanf("%m[^\n]", &command); getchar();
-		if (!command)
-			break;
+	switch (cmd) {
+	case 'L': {
+		load_file(&(*command), &(*image)); break;
+	}
+	case 's': {
+		select_area(&(*command), &(*image)); break;
+	}
+	case 'S': {
+		select_all(&(*image)); break;
+	}
+	case 'H': {
+		histogram_image(&(*command), &(*image)); break;
+	}
+	case 'E': {
+		equalize_image(&(*image)); break;
+	}
+	case 'I': {
+		point_image(&(*command), &(*image), 'I'); break;
+	}
+	case 'G': {
+		point_image(&(*command), &(*image), 'G'); break;
+	}
+	case 'V': {
+		point_image(&(*command), &(*image), 'L'); break;
+	}
+	case 'T': {
+		point_image(&(*command), &(*image), 'T'); break;
+	}
+	case 'R': {
+		rotate_area(&(*command), &(*image)); break;
+	}
+	case 'C': {
+		crop_image(&(*image)); break;
+	}
+	case 'F': {
+		flip_area(&(*command), &(*image)); break;
+	}
+	case 'A': {
+		apply_area(&(*command), &(*image)); break;
+	}
+	case 'N': {
+		set_threads(&(*command)); break;
+	}
+	case 'P': {
+		pipeline_mode(&(*command), &(*image)); break;
+	}
+	case '$': {
+		save_file(&(*command), &(*image)); break;
+	}
+	case '0': {
+		report("No image loaded\n"); break;
+	}
+	case '1': {
+		return 0;
+	}
 
-		// execute corresponding command
-		char cmd = command_selection(command, image);
+	default: {
+		report("Invalid command\n"); break;
+	}
+	}
 
-		switch (cmd) {
-		case 'L': {
-			load_file(&command, &image); break;
-		}
-		case 's': {
-			select_area(&command, &image); break;
-		}
-		case 'S': {
-			select_all(&image); break;
-		}
-		case 'H': {
-			histogram_image(&command, &image); break;
-		}
-		case 'E': {
-			equalize_image(&image); break;
+	return 1;
+}
+
+// --batch <script> [--jobs <n>] <file>...: the script is run once for
+// each file, by n workers, each with its own image_data
+struct batch {
+	char **lines; int line_count; // the script
+	char **files; int file_count;
+	int next; // first file not taken by a worker
+	int printed; // files whose messages are on stdout
+	char **output; size_t *output_size; // messages of the finished files
+	char *done;
+	pthread_mutex_t lock;
+};
+
+char *batch_line(const char *line, const char *file)
+{
+	// line of the script for file: {} - its path, {name} - its name,
+	// without directory and extension
+	const char *name = strrchr(file, '/');
+	name = name ? name + 1 : file;
+	const char *dot = strrchr(name, '.');
+	size_t name_len = dot && dot != name ? (size_t)(dot - name)
+										 : strlen(name);
+	size_t file_len = strlen(file), size = 1;
+
+	for (const char *p = line; *p; p++)
+		if (!strncmp(p, "{}", 2))
+			size += file_len, p++;
+		else if (!strncmp(p, "{name}", 6))
+			size += name_len, p += 5;
+		else
+			size++;
+
+	char *command = (char *)malloc(size);
+	if (!command) {
+		fprintf(stderr, "Malloc for %s failed\n", var_name(command));
+		return NULL;
+	}
+
+	char *out = command;
+	for (const char *p = line; *p; p++)
+		if (!strncmp(p, "{}", 2)) {
+			memcpy(out, file, file_len);
+			out += file_len; p++;
+		} else if (!strncmp(p, "{name}", 6)) {
+			memcpy(out, name, name_len);
+			out += name_len; p += 5;
+		} else {
+			*out++ = *p;
 		}
-		case 'R': {
-			rotate_area(&command, &image); break;
+	*out = '\0';
+	return command;
+}
+
+void *batch_worker(void *arg)
+{
+	struct batch *batch = (struct batch *)arg;
+
+	// the pixel buffer of an image is kept for the next file
+	struct image_data image = {0};
+
+	while (1) {
+		pthread_mutex_lock(&(*batch).lock);
+		int index = (*batch).next++;
+		pthread_mutex_unlock(&(*batch).lock);
+		if (index >= (*batch).file_count)
+			break;
+
+		char *buffer = NULL; size_t size = 0;
+		messages = open_memstream(&buffer, &size);
+		if (!messages) {
+			fprintf(stderr, "Open_memstream for %s failed\n",
+					var_name(messages));
+			messages = stderr;
 		}
-		case 'C': {
-			crop_image(&image); break;
+
+		for (int i = 0; i < (*batch).line_count; i++) {
+			char *command = batch_line((*batch).lines[i],
+									   (*batch).files[index]);
+			if (!command)
+				break;
+			int run = run_command(&command, &image);
+			free(command);
+			if (!run)
+				break;
 		}
-		case 'A': {
-			apply_area(&command, &image); break;
+		free_image(&image, 2);
+
+		if (messages != stderr)
+			fclose(messages);
+		messages = NULL;
+
+		// messages are printed in the order of the files
+		pthread_mutex_lock(&(*batch).lock);
+		(*batch).output[index] = buffer;
+		(*batch).output_size[index] = buffer ? size : 0;
+		(*batch).done[index] = 1;
+		while ((*batch).printed < (*batch).file_count &&
+			   (*batch).done[(*batch).printed]) {
+			int k = (*batch).printed++;
+			if ((*batch).output[k])
+				fwrite((*batch).output[k], 1, (*batch).output_size[k],
+					   stdout);
+			free((*batch).output[k]);
 		}
-		case '$': {
-			save_file(&command, &image); break;
+		fflush(stdout);
+		pthread_mutex_unlock(&(*batch).lock);
+	}
+
+	free_image(&image, 1);
+	return NULL;
+}
+
+int batch_read_script(struct batch *batch, const char *name)
+{
+	// the lines of the script, without the empty ones
+	FILE *script = fopen(name, "rt");
+	if (!script) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return 0;
+	}
+
+	char *line = NULL; size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, script)) != -1) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		char **lines = (char **)realloc((*batch).lines,
+										((*batch).line_count + 1) *
+										sizeof(char *));
+		char *copy = strdup(line);
+		if (!lines || !copy) {
+			fprintf(stderr, "Malloc for %s failed\n", var_name(lines));
+			if (lines)
+				(*batch).lines = lines;
+			free(copy); free(line); fclose(script);
+			return 0;
 		}
-		case '0': {
-			printf("No image loaded\n"); break;
+		(*batch).lines = lines;
+		(*batch).lines[(*batch).line_count++] = copy;
+	}
+
+	free(line);
+	fclose(script);
+	return 1;
+}
+
+int batch_run(const char *script, int jobs, char **files, int file_count)
+{
+	struct batch batch = {0};
+	batch.files = files; batch.file_count = file_count;
+	batch.output = (char **)calloc(file_count + 1, sizeof(char *));
+	batch.output_size = (size_t *)calloc(file_count + 1, sizeof(size_t));
+	batch.done = (char *)calloc(file_count + 1, 1);
+	int ok = batch.output && batch.output_size && batch.done;
+	if (!ok)
+		fprintf(stderr, "Malloc for %s failed\n", var_name(batch.output));
+	ok = ok && batch_read_script(&batch, script);
+
+	// the digit table is built once, before the workers share it
+	if (ok && !init_digit_table())
+		ok = 0;
+
+	pthread_t *threads = NULL;
+	if (ok) {
+		if (jobs > file_count)
+			jobs = file_count;
+		if (jobs > 1)
+			threads = (pthread_t *)malloc((jobs - 1) * sizeof(pthread_t));
+		if (!threads)
+			jobs = 1;
+	}
+
+	if (ok) {
+		// the calling thread is one of the workers
+		pthread_mutex_init(&batch.lock, NULL);
+		int started = 0;
+		while (started < jobs - 1 &&
+			   !pthread_create(&threads[started], NULL, batch_worker,
+							   &batch))
+			started++;
+		batch_worker(&batch);
+		for (int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&batch.lock);
+	}
+
+	free(threads);
+	for (int i = 0; i < batch.line_count; i++)
+		free(batch.lines[i]);
+	free(batch.lines);
+	free(batch.output);
+	free(batch.output_size);
+	free(batch.done);
+	return ok;
+}
+
+// commands read from stdin ahead of their execution, by an I/O thread
+// that also decodes the files of the LOAD commands among them
+#define PREFETCH_LINES 256 // lines read ahead
+#define PREFETCH_IMAGES 2 // LOAD commands decoded ahead
+
+struct prefetch_entry {
+	char *command;
+	int load; // a LOAD decoded ahead: 1 - being decoded, 2 - done
+	struct image_data *image; // its image (NULL - allocation failed)
+	int found; struct stat info; // 0 - no such file; else, what was read
+};
+
+struct prefetch {
+	struct prefetch_entry entries[PREFETCH_LINES]; // ring
+	int head, count; // first entry not taken, entries read ahead
+	int images; // LOAD entries among them
+	int eof, stop;
+	char *line; size_t line_size; // getline buffer of the reader
+	int started; pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+};
+
+int prefetch_target(const char *command)
+{
+	// plain LOAD of a file small enough to be held next to the image
+	if (strncmp(command, "LOAD ", 5))
+		return 0;
+
+	char *file_name = strdup(command + 5);
+	if (!file_name)
+		return 0;
+	int use_mmap, use_stream;
+	int options = load_options(file_name, &use_mmap, &use_stream);
+	struct stat info;
+	int found = !stat(file_name, &info);
+	free(file_name);
+
+	return !options && found &&
+		   (size_t)info.st_size <= memory_limit() / (PREFETCH_IMAGES + 2);
+}
+
+void *prefetch_reader(void *arg)
+{
+	struct prefetch *prefetch = (struct prefetch *)arg;
+
+	// cancelled (at EXIT) only while waiting for a line
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1) {
+		pthread_mutex_lock(&(*prefetch).lock);
+		while (!(*prefetch).stop &&
+			   ((*prefetch).count == PREFETCH_LINES ||
+				(*prefetch).images == PREFETCH_IMAGES))
+			pthread_cond_wait(&(*prefetch).room, &(*prefetch).lock);
+		int stop = (*prefetch).stop;
+		pthread_mutex_unlock(&(*prefetch).lock);
+		if (stop)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ssize_t len = getline(&(*prefetch).line, &(*prefetch).line_size,
+							  stdin);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		char *command = NULL;
+		if (len != -1) {
+			if (len && (*prefetch).line[len - 1] == '\n')
+				(*prefetch).line[len - 1] = '\0';
+			command = strdup((*prefetch).line);
 		}
-		case '1': {
-			run = 0; break;
+		int load = command && prefetch_target(command);
+
+		pthread_mutex_lock(&(*prefetch).lock);
+		if (!command || (*prefetch).stop) {
+			(*prefetch).eof = 1;
+			pthread_cond_broadcast(&(*prefetch).ready);
+			pthread_mutex_unlock(&(*prefetch).lock);
+			free(command);
+			break;
 		}
+		struct prefetch_entry *entry = &(*prefetch).entries[
+			((*prefetch).head + (*prefetch).count) % PREFETCH_LINES];
+		(*entry).command = command; (*entry).load = load;
+		(*entry).image = NULL; (*entry).found = 0;
+		(*prefetch).count++;
+		(*prefetch).images += load;
+		pthread_cond_broadcast(&(*prefetch).ready);
+		pthread_mutex_unlock(&(*prefetch).lock);
+		if (!load)
+			continue;
 
-		default: {
-			printf("Invalid command\n"); break;
+		// the entry stays in the ring until it is decoded
+		struct image_data *image;
+		image = (struct image_data *)calloc(1, sizeof(*image));
+		struct stat info;
+		int found = 0;
+		if (!image)
+			fprintf(stderr, "Calloc for %s failed\n", var_name(image));
+		else {
+			// the decoder of text files runs on the pool
+			pthread_mutex_lock(&pool_rebuild);
+			found = read_image(command + 5, image, 0, 0, &info);
+			pthread_mutex_unlock(&pool_rebuild);
 		}
+
+		pthread_mutex_lock(&(*prefetch).lock);
+		(*entry).image = image; (*entry).found = found;
+		if (found)
+			(*entry).info = info;
+		(*entry).load = 2; // decoded
+		pthread_cond_broadcast(&(*prefetch).ready);
+		pthread_mutex_unlock(&(*prefetch).lock);
+	}
+	return NULL;
+}
+
+void prefetch_start(struct prefetch *prefetch)
+{
+	// without the I/O thread, commands are read when they are needed
+	pthread_mutex_init(&(*prefetch).lock, NULL);
+	pthread_cond_init(&(*prefetch).ready, NULL);
+	pthread_cond_init(&(*prefetch).room, NULL);
+	(*prefetch).started = !pthread_create(&(*prefetch).reader, NULL,
+										  prefetch_reader, prefetch);
+}
+
+int prefetch_next(struct prefetch *prefetch, struct prefetch_entry *entry)
+{
+	// next command (0 - end of the input), with its image if it is a
+	// LOAD decoded ahead
+	if (!(*prefetch).started) {
+		ssize_t len = getline(&(*prefetch).line, &(*prefetch).line_size,
+							  stdin);
+		if (len == -1)
+			return 0;
+		if (len && (*prefetch).line[len - 1] == '\n')
+			(*prefetch).line[len - 1] = '\0';
+		(*entry).command = strdup((*prefetch).line);
+		(*entry).load = 0; (*entry).image = NULL;
+		return (*entry).command != NULL;
+	}
+
+	pthread_mutex_lock(&(*prefetch).lock);
+	while (!(*prefetch).count && !(*prefetch).eof)
+		pthread_cond_wait(&(*prefetch).ready, &(*prefetch).lock);
+	int taken = (*prefetch).count > 0;
+	if (taken) {
+		struct prefetch_entry *first;
+		first = &(*prefetch).entries[(*prefetch).head];
+		while ((*first).load == 1)
+			pthread_cond_wait(&(*prefetch).ready, &(*prefetch).lock);
+
+		*entry = *first;
+		(*prefetch).head = ((*prefetch).head + 1) % PREFETCH_LINES;
+		(*prefetch).count--;
+		(*prefetch).images -= (*entry).load != 0;
+		pthread_cond_broadcast(&(*prefetch).room);
+	}
+	pthread_mutex_unlock(&(*prefetch).lock);
+	return taken;
+}
+
+void prefetch_stop(struct prefetch *prefetch)
+{
+	// stop the I/O thread and free what it read ahead
+	if ((*prefetch).started) {
+		pthread_mutex_lock(&(*prefetch).lock);
+		(*prefetch).stop = 1;
+		pthread_cond_broadcast(&(*prefetch).room);
+		pthread_mutex_unlock(&(*prefetch).lock);
+		pthread_cancel((*prefetch).reader);
+		pthread_join((*prefetch).reader, NULL);
+	}
+
+	for (int i = 0; i < (*prefetch).count; i++) {
+		struct prefetch_entry *entry = &(*prefetch).entries[
+			((*prefetch).head + i) % PREFETCH_LINES];
+		free((*entry).command);
+		if ((*entry).image)
+			free_image((*entry).image, 1);
+		free((*entry).image);
+	}
+	free((*prefetch).line);
+	pthread_cond_destroy(&(*prefetch).ready);
+	pthread_cond_destroy(&(*prefetch).room);
+	pthread_mutex_destroy(&(*prefetch).lock);
+}
+
+int same_file(const struct stat *a, const struct stat *b)
+{
+	return (*a).st_dev == (*b).st_dev && (*a).st_ino == (*b).st_ino &&
+		   (*a).st_size == (*b).st_size &&
+		   (*a).st_mtim.tv_sec == (*b).st_mtim.tv_sec &&
+		   (*a).st_mtim.tv_nsec == (*b).st_mtim.tv_nsec;
+}
+
+void load_prefetched(char **command, struct image_data *image,
+					 struct prefetch_entry *entry)
+{
+	// LOAD <file> command decoded ahead: the image is swapped in, unless
+	// the file changed since (e.g. a SAVE to it), then it is read again
+	char *file_name = *command + 5;
+	struct stat info;
+	if (!(*entry).image || !(*entry).found || stat(file_name, &info) ||
+		!same_file(&info, &(*entry).info)) {
+		if ((*entry).image)
+			free_image((*entry).image, 1);
+		free((*entry).image);
+		load_file(&(*command), &(*image));
+		return;
+	}
+
+	// PIPELINE ON/OFF is kept across images
+	int pipeline = (*image).pipeline;
+	free_image(&(*image), 1);
+	*image = *(*entry).image;
+	(*image).pipeline = pipeline;
+	free((*entry).image);
+
+	report("Loaded %s\n", file_name);
+}
+
+int main(int argc, char **argv)
+{
+	// input commands will be stored in *command
+	char *command;
+
+	// options: --max-memory <size> (tile store of streamed images),
+	// --batch <script> [--jobs <n>] <file>...
+	char *script = NULL;
+	int jobs = 0, first = argc, usage = 0;
+	for (int i = 1; i < argc && first == argc && !usage; i++) {
+		if (!strcmp(argv[i], "--max-memory") && i + 1 < argc &&
+			parse_size(argv[i + 1])) {
+			max_memory = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+			script = argv[++i];
+		} else if (!strcmp(argv[i], "--jobs") && i + 1 < argc &&
+				   atoi(argv[i + 1]) > 0) {
+			jobs = atoi(argv[++i]);
+		} else if (script && argv[i][0] != '-') {
+			first = i;
+		} else {
+			usage = 1;
 		}
+	}
+	if (usage || (script && first == argc) || (jobs && !script)) {
+		fprintf(stderr, "Usage: %s [--max-memory <size>[K|M|G]] "
+				"[--batch <script> [--jobs <n>] <file>...]\n", argv[0]);
+		return 1;
+	}
 
-		if (command && cmd != '1')
-			free(command);
+	// init image struct
+	struct image_data image = {0};
+
+	init_cpu_kernels();
+	int threads = default_threads();
+	pool_init(&pool, threads < THREADS_MAX ? threads : THREADS_MAX);
+
+	if (script) {
+		int ok = batch_run(script, jobs ? jobs : threads, argv + first,
+						   argc - first);
+		free(digit_table);
+		pool_destroy(&pool);
+		return ok ? 0 : 1;
 	}
 
-	// free resources
-	if (command)
+	// Execute commands until we reach the EXIT case,
+	// with a loaded image
+	struct prefetch prefetch = {0};
+	prefetch_start(&prefetch);
+
+	struct prefetch_entry entry;
+	int run = 1;
+	while (run && prefetch_next(&prefetch, &entry)) {
+		command = entry.command;
+
+		// execute corresponding command
+		if (entry.load)
+			load_prefetched(&command, &image, &entry);
+		else
+			run = run_command(&command, &image);
+
 		free(command);
-	if (image.area)
+	}
+
+	// free resources
+	prefetch_stop(&prefetch);
+	if (image_loaded(&image))
 		free_image(&image, 1);
+	free(digit_table);
+	pool_destroy(&pool);
 
 	return 0;
 }
@@ -0,0 +1,33 @@
+#!/bin/sh
+# THREADS between LOAD commands read ahead: the pool is rebuilt while the
+# I/O thread may be decoding the next text file on it. The images saved
+# must not depend on the number of threads; run with a -fsanitize=thread
+# build to check for races.
+# usage: tests/prefetch_threads.sh [image_editor]
+editor=$(realpath "${1:-./image_editor}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+# a small and a large (a few MiB) text image
+awk 'BEGIN { print "P2\n4 4\n255"; for (i = 0; i < 16; i++) print i * 16 }' \
+	> small.pgm
+awk 'BEGIN { w = 1200; h = 1000; print "P2\n" w " " h "\n255"
+	for (i = 0; i < h; i++) { line = ""
+		for (j = 0; j < w; j++) line = line " " (i * 7 + j * 13) % 256
+		print line } }' > big.pgm
+
+status=0
+for threads in 1 3 8 2; do
+	printf 'LOAD small.pgm\nTHREADS %s\nLOAD big.pgm\nTHREADS 1\nLOAD small.pgm\nLOAD big.pgm\nSAVE out%s.pgm\nEXIT\n' \
+		"$threads" "$threads" | "$editor" > log 2>&1
+	if [ $? -ne 0 ] || grep -q "WARNING\|ERROR" log; then
+		cat log; status=1
+	fi
+	if ! cmp -s out1.pgm "out$threads.pgm"; then
+		echo "THREADS $threads: different image"; status=1
+	fi
+done
+
+[ $status -eq 0 ] && echo "prefetch_threads: OK"
+exit $status